@@ -15,6 +15,8 @@
 #include <pistache/endpoint.h>
 #include <pistache/common.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/file.h>
 #include "smartlight.cpp"
 #include <mosquitto.h>
 
@@ -33,12 +35,21 @@ void onConnect(struct mosquitto *mosq, void *obj, int rc) {
 		printFatal("Error with result code: " + to_string(rc));
 		exit(-1);
 	}
-	mosquitto_subscribe(mosq, NULL, "test/t1", 0);
+	// QoS 1: the alerts published while a hot restart moves the session are kept by the broker.
+	// test/<id> is about one light, any other topic (test/t1) about all of them
+	mosquitto_subscribe(mosq, NULL, "test/+", 1);
 }
 
 
+// The server the MQTT alerts are recorded by
+SmartLightEndpoint *smartLightServer = nullptr;
+
 void onMessage(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
     string s = (char *) msg->payload;
+
+    if (smartLightServer)
+        smartLightServer->recordMqtt(msg->topic, string((char *) msg->payload, msg->payloadlen));
+
     int value = 0;
     for (int i = 0; i < (int)s.size(); i++) {
         if (s[i] >= '0' && s[i] <= '9') {
@@ -48,6 +59,14 @@ void onMessage(struct mosquitto *mosq, void *obj, const struct mosquitto_message
 
     if (value != 0) {
         printInfo((string)"New message with topic " + msg->topic + ": " + to_string(value));
+
+        // a topic ending in a light id (test/3) is about that light, any other one about all of them
+        string topic = msg->topic;
+        string last = topic.substr(topic.rfind('/') + 1);
+        int light = (! last.empty() && std::all_of(last.begin(), last.end(), ::isdigit)) ? (int) strtol(last.c_str(), nullptr, 10) : -1;
+        if (smartLightServer)
+            smartLightServer->recordImpact(light, value);
+
         alertCounter ++;
         if (value >= 50 || alertCounter >= 3) {
             printWarn("Stop tempering with the installation NOW! Shut down the installation first!");
@@ -61,14 +80,92 @@ void onMessage(struct mosquitto *mosq, void *obj, const struct mosquitto_message
 }
 
 
+// Hot restart: the running server keeps its pid here so the new one can find it, and holds an
+// exclusive flock on the file while it runs. A file nobody holds was left by a server that crashed
+// (its pid may be another process now) and is never signaled.
+const char* pidFile = "server.pid";
+int pidLock = -1;
+
+pid_t ReadPid() {
+    FILE *f = fopen(pidFile, "r");
+    int pid = 0;
+    if (f) {
+        if (fscanf(f, "%d", &pid) != 1)
+            pid = 0;
+        fclose(f);
+    }
+    return pid;
+}
+
+// The pid of the server running in this directory, 0 if none holds the pid file
+pid_t RunningPid() {
+    int fd = open(pidFile, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    bool held = flock(fd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+    close(fd);
+    return held ? ReadPid() : 0;
+}
+
+// Write our pid and hold the lock of the file until ReleasePid; false if another server holds it
+bool WritePid(pid_t pid) {
+    int fd = open(pidFile, O_RDWR | O_CREAT, (mode_t)0644);
+    if (fd == -1)
+        return false;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return false;
+    }
+    string line = to_string(pid) + "\n";
+    if (ftruncate(fd, 0) != 0 || write(fd, line.c_str(), line.size()) != (ssize_t) line.size()) {
+        close(fd);
+        return false;
+    }
+    pidLock = fd;
+    return true;
+}
+
+void ReleasePid() {
+    if (pidLock != -1)
+        close(pidLock);
+    pidLock = -1;
+}
+
+// Ask the running server to hand over and wait until it stopped changing the lights and released
+// the MQTT session. Its HTTP port is already shared with us (SO_REUSEPORT), it exits by itself.
+// false if it did not hand over in time (it may still be changing the lights).
+bool TakeOver() {
+    pid_t old = RunningPid();
+    if (old <= 0 || old == getpid() || kill(old, SIGUSR2) != 0) {
+        printWarn("No running server to take over from");
+        return true;
+    }
+    printInfo("Taking over from the server " + to_string(old));
+
+    sigset_t released;
+    sigemptyset(&released);
+    sigaddset(&released, SIGUSR1);
+    // the old server waits up to 5s for its requests in flight
+    struct timespec timeout = {10, 0};
+    siginfo_t info;
+    while (sigtimedwait(&released, &info, &timeout) == SIGUSR1) {
+        if (info.si_pid == old)
+            return true;
+    }
+    return false;
+}
+
 int main(int argc, char *argv[]) {
 
     // This code is needed for gracefull shutdown of the server when no longer needed.
+    // SIGUSR2 asks for a hot restart hand over, SIGUSR1 confirms it (see TakeOver).
     sigset_t signals;
     if (sigemptyset(&signals) != 0
             || sigaddset(&signals, SIGTERM) != 0
             || sigaddset(&signals, SIGINT) != 0
             || sigaddset(&signals, SIGHUP) != 0
+            || sigaddset(&signals, SIGUSR1) != 0
+            || sigaddset(&signals, SIGUSR2) != 0
             || pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0) {
         perror("install signal handler failed");
         return 1;
@@ -80,32 +177,194 @@ int main(int argc, char *argv[]) {
     // Number of threads used by the server
     int thr = 2;
 
+    // Number of listeners (endpoints bound to the same port)
+    int listeners = 1;
+
+    // Replace the server already running on the port without downtime
+    // (and let a later build replace this one the same way)
+    bool takeover = false;
+
+    // Read-only replica of the server running in the same directory (on another port)
+    bool replica = false;
+
+    // Rate and queue depth limits (requests over them get 429 Too Many Requests)
+    LightLimit::Config limits;
+
+    // File the traffic is captured to, for replay
+    string capture = "";
+
+    // Trace one request out of every traceRate (0: no tracing)
+    int traceRate = 0;
+
+    // Cluster mode: the members (host:port) the lights are partitioned between, the name
+    // of this server among them and the member to join a running cluster through
+    vector<string> members;
+    string node = "";
+    string seed = "";
+    string secret = "";
+
+    // Port of the WebSocket control channel (0: none) and the origins of the web pages allowed to use it
+    int controlPort = 0;
+    vector<string> controlOrigins;
+
+    // Patch of the DMX universes onto the lights ("": no DMX)
+    string dmxPatch = "";
+
     if (argc >= 2) {
         port = static_cast<uint16_t>(std::stol(argv[1]));
 
-        if (argc == 3)
+        if (argc >= 3)
             thr = std::stoi(argv[2]);
+
+        // the options after the number of threads can be given in any order
+        for (int i = 3; i < argc; i++) {
+            string option = argv[i];
+            string value = option.substr(option.find('=') + 1);
+            if (option == "takeover")
+                takeover = true;
+            else if (option == "replica")
+                replica = true;
+            else if (option == "percore")
+                listeners = hardware_concurrency();
+            else if (option.rfind("clientrate=", 0) == 0)
+                limits.clientRate = limits.clientBurst = std::stod(value);
+            else if (option.rfind("lightrate=", 0) == 0)
+                limits.lightRate = limits.lightBurst = std::stod(value);
+            else if (option.rfind("maxinflight=", 0) == 0)
+                limits.maxInFlight = std::stoi(value);
+            else if (option.rfind("record=", 0) == 0)
+                capture = value;
+            else if (option.rfind("trace=", 0) == 0)
+                traceRate = std::stoi(value);
+            else if (option.rfind("cluster=", 0) == 0) {
+                for (size_t start = 0, end; start < value.size(); start = end + 1) {
+                    end = std::min(value.find(',', start), value.size());
+                    members.push_back(value.substr(start, end - start));
+                }
+            }
+            else if (option.rfind("node=", 0) == 0)
+                node = value;
+            else if (option.rfind("join=", 0) == 0)
+                seed = value;
+            else if (option.rfind("secret=", 0) == 0)
+                secret = value;
+            else if (option.rfind("control=", 0) == 0)
+                controlPort = std::stoi(value);
+            else if (option.rfind("controlorigin=", 0) == 0)
+                controlOrigins.push_back(value);
+            else if (option.rfind("dmx=", 0) == 0)
+                dmxPatch = value;
+            else
+                printWarn("Unknown option " + option);
+        }
     }
 
+    // one thread per listener, each listener pinned to its own core
+    if (listeners > 1)
+        thr = 1;
+
     Address addr(Ipv4::any(), port);
 
     printInfo("Cores = " + to_string(hardware_concurrency()));
-    printInfo("Using " + to_string(thr) + " threads");
+    printInfo("Using " + to_string(listeners) + " listeners with " + to_string(thr) + " threads each");
 
     // Instance of the class that defines what the server can do.
-    SmartLightEndpoint stats(addr);
+    SmartLightEndpoint stats(addr, replica);
+    smartLightServer = &stats;
 
     // Initialize and start the server
-    stats.init(thr);
+    stats.init(thr, listeners, takeover);
+    stats.setLimits(limits);
+    stats.setTracing(traceRate);
+    if (capture != "") {
+        try {
+            stats.startCapture(capture);
+            printInfo("Capturing the traffic to " + capture);
+        } catch (char const* str) {
+            printError(str);
+        }
+    }
+    bool cluster = ! members.empty() || seed != "";
+    if (cluster && secret == "") {
+        printFatal("A cluster needs the secret its members share, given with secret=<secret>");
+        return -1;
+    }
+    if (cluster) {
+        if (node == "")
+            node = "127.0.0.1:" + to_string((uint16_t) port);
+        if (seed != "")
+            members = {seed};
+        else if (std::find(members.begin(), members.end(), node) == members.end())
+            members.push_back(node);
+        stats.enableCluster(node, members, secret);
+    }
+    if (controlPort && replica)
+        printWarn("The control channel is not available on replicas");
+    else if (controlPort) {
+        try {
+            stats.enableControl(controlPort, controlOrigins);
+            printInfo("Control channel on port " + to_string(controlPort));
+        } catch (char const* str) {
+            printError(str);
+        }
+    }
+    if (dmxPatch != "" && replica)
+        printWarn("DMX is not available on replicas");
+    else if (dmxPatch != "") {
+        try {
+            stats.enableDmx(dmxPatch);
+            printInfo("Receiving DMX for the lights patched in " + dmxPatch);
+        } catch (char const* str) {
+            printError(str);
+        }
+    }
     stats.start();
 
+    // the requests wait while the old server hands over, only one server changes the lights at a time
+    if (takeover && ! TakeOver()) {
+        printFatal("The old server did not hand over in time");
+        stats.stop();
+        return -1;
+    }
+    if (! stats.activate()) {
+        printFatal("Refusing to run without the lights of SettingConfigs.data");
+        stats.stop();
+        return -1;
+    }
+
+    if (replica) {
+        // the writing server owns the MQTT session and the pid file
+        printInfo("Serving the lights of SettingConfigs.data read-only");
+        int signal = 0;
+        do {
+            signal = sigwaitinfo(&signals, nullptr);
+        } while (signal == SIGUSR1 || (signal == -1 && errno == EINTR));
+        printInfo("received signal " + to_string(signal));
+        stats.stop();
+        return 0;
+    }
+
+    if (seed != "") {
+        if (stats.joinCluster(seed))
+            printInfo("Joined the cluster through " + seed);
+        else
+            printError("Could not join the cluster through " + seed);
+    }
+
+    if (! WritePid(getpid()))
+        printWarn("Another server holds " + (string) pidFile + ", this one cannot be taken over");
+
     int rc, id=12;
 
     mosquitto_lib_init();
 
     struct mosquitto *mosq;
 
-    mosq = mosquitto_new("subscribe-test", true, &id);
+    // A persistent session (clean_session = false) lets the broker keep the QoS 1 messages
+    // published while a hot restart moves the session to the new server.
+    // (the members of a cluster each have their own session)
+    string clientId = cluster ? "subscribe-test-" + node : "subscribe-test";
+    mosq = mosquitto_new(clientId.c_str(), false, &id);
     mosquitto_connect_callback_set(mosq, onConnect);
     mosquitto_message_callback_set(mosq, onMessage);
 
@@ -116,25 +375,32 @@ int main(int argc, char *argv[]) {
     }
 
     mosquitto_loop_start(mosq);
-    //std :: cout << "Type exit to cancel:"
-    getchar();
-    mosquitto_loop_stop(mosq, true);
+
+    // Code that waits for the shutdown sinal for the server
+    siginfo_t info;
+    int signal = 0;
+    do {
+        signal = sigwaitinfo(&signals, &info);
+    } while (signal == SIGUSR1 || (signal == -1 && errno == EINTR));
+    printInfo("received signal " + to_string(signal));
+
+    // hot restart: stop changing the lights before the new server starts to
+    if (signal == SIGUSR2)
+        stats.handOver();
 
     mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, true);
     mosquitto_destroy(mosq);
     mosquitto_lib_cleanup();
 
-    // Code that waits for the shutdown sinal for the server
-    int signal = 0;
-    int status = sigwait(&signals, &signal);
-    if (status == 0)
-    {
-        printInfo("received signal " + to_string(signal));
-    }
-    else
-    {
-        printInfo("sigwait returns " + to_string(status));
+    if (signal == SIGUSR2) {
+        // the new server may change the lights, connect to the broker and hold the pid file now
+        ReleasePid();
+        kill(info.si_pid, SIGUSR1);
     }
+    stats.stop();
 
-  stats.stop();
+    if (pidLock != -1 && ReadPid() == getpid())
+        unlink(pidFile);
+    ReleasePid();
 }
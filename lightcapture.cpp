@@ -0,0 +1,187 @@
+// Capture of the traffic received by the server (HTTP requests and MQTT messages)
+// into a compact binary log, and reading it back (see replay.cpp).
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// Log format: the 8 byte magic "SLCAP001", then one entry after the other:
+//   type (1 byte: 1 HTTP, 2 MQTT)
+//   microseconds since the previous entry (varint)
+//   HTTP: method (1 byte), resource (varint length + bytes), body (varint length + bytes)
+//   MQTT: topic (varint length + bytes), payload (varint length + bytes)
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace LightCapture {
+
+    static const char Magic[8] = {'S', 'L', 'C', 'A', 'P', '0', '0', '1'};
+
+    enum Type : uint8_t {
+        Http = 1,
+        Mqtt = 2
+    };
+
+    static const char* Methods[] = {"", "GET", "POST", "PUT", "DELETE"};
+
+    struct Entry {
+        Type type;
+        uint64_t time;       // microseconds since the capture started
+        uint8_t method;      // index in Methods (HTTP only)
+        std::string target;  // resource (HTTP) or topic (MQTT)
+        std::string payload; // body (HTTP) or payload (MQTT)
+    };
+
+    uint8_t MethodIndex(const std::string &name) {
+        for (uint8_t i = 1; i < sizeof(Methods) / sizeof(Methods[0]); i++) {
+            if (name == Methods[i])
+                return i;
+        }
+        return 0;
+    }
+
+    // The entries are buffered and flushed once a second, a crash loses at most the last second
+    class Recorder {
+    public:
+        explicit Recorder(const std::string &path) {
+            file = fopen(path.c_str(), "wb");
+            if (! file)
+                throw "Error opening the capture file";
+            fwrite(Magic, 1, sizeof(Magic), file);
+            started = last = std::chrono::steady_clock::now();
+            flusher = std::thread(&Recorder::Flush, this);
+        }
+
+        ~Recorder() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+                wakeup.notify_all();
+            }
+            flusher.join();
+            if (file)
+                fclose(file);
+        }
+
+        void RecordHttp(const std::string &method, const std::string &resource, const std::string &body) {
+            Record(Http, MethodIndex(method), resource, body);
+        }
+
+        void RecordMqtt(const std::string &topic, const std::string &payload) {
+            Record(Mqtt, 0, topic, payload);
+        }
+
+    private:
+        void Record(Type type, uint8_t method, const std::string &target, const std::string &payload) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto now = std::chrono::steady_clock::now();
+            uint64_t delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+            last = now;
+
+            fputc(type, file);
+            PutVarint(delta);
+            if (type == Http)
+                fputc(method, file);
+            PutVarint(target.size());
+            fwrite(target.data(), 1, target.size(), file);
+            PutVarint(payload.size());
+            fwrite(payload.data(), 1, payload.size(), file);
+            dirty = true;
+        }
+
+        void Flush() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (! stopping) {
+                wakeup.wait_for(guard, std::chrono::seconds(1));
+                if (dirty)
+                    fflush(file);
+                dirty = false;
+            }
+        }
+
+        void PutVarint(uint64_t value) {
+            while (value >= 0x80) {
+                fputc((int) (value & 0x7f) | 0x80, file);
+                value >>= 7;
+            }
+            fputc((int) value, file);
+        }
+
+        std::mutex lock;
+        FILE *file = nullptr;
+        std::chrono::steady_clock::time_point started, last;
+        // flushing the entries of the last second
+        std::condition_variable wakeup;
+        std::thread flusher;
+        bool dirty = false, stopping = false;
+    };
+
+    class Reader {
+    public:
+        explicit Reader(const std::string &path) {
+            file = fopen(path.c_str(), "rb");
+            if (! file)
+                throw "Error opening the capture file";
+            char magic[sizeof(Magic)];
+            if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, Magic, sizeof(Magic)))
+                throw "The file is not a SmartLight capture";
+        }
+
+        ~Reader() {
+            if (file)
+                fclose(file);
+        }
+
+        // false at the end of the log
+        bool Next(Entry &entry) {
+            int type = fgetc(file);
+            if (type == EOF)
+                return false;
+            if (type != Http && type != Mqtt)
+                throw "The capture is corrupted";
+
+            entry.type = (Type) type;
+            time += GetVarint();
+            entry.time = time;
+            entry.method = 0;
+            if (entry.type == Http) {
+                int method = fgetc(file);
+                if (method == EOF)
+                    throw "The capture is truncated";
+                if (method == 0 || method >= (int) (sizeof(Methods) / sizeof(Methods[0])))
+                    throw "The capture is corrupted";
+                entry.method = (uint8_t) method;
+            }
+            GetString(entry.target);
+            GetString(entry.payload);
+            return true;
+        }
+
+    private:
+        uint64_t GetVarint() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                int byte = fgetc(file);
+                if (byte == EOF)
+                    throw "The capture is truncated";
+                value |= (uint64_t) (byte & 0x7f) << shift;
+                if (! (byte & 0x80))
+                    return value;
+            }
+            throw "The capture is corrupted";
+        }
+
+        void GetString(std::string &out) {
+            out.resize(GetVarint());
+            if (! out.empty() && fread(&out[0], 1, out.size(), file) != out.size())
+                throw "The capture is truncated";
+        }
+
+        FILE *file = nullptr;
+        uint64_t time = 0;
+    };
+}
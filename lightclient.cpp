@@ -0,0 +1,157 @@
+// Minimal HTTP/1.1 client over one persistent connection, used to talk to other
+// SmartLight servers (see lightcluster.cpp and replay.cpp).
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+
+#include <algorithm>
+#include <string>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace LightClient {
+
+    class Connection {
+    public:
+        Connection(const std::string &host, int port, int timeoutSeconds = 5)
+            : host(host == "localhost" ? "127.0.0.1" : host), port(port), timeout(timeoutSeconds)
+        {}
+
+        ~Connection() {
+            Close();
+        }
+
+        Connection(const Connection&) = delete;
+        Connection& operator= (const Connection&) = delete;
+
+        // Send a request and wait for the whole response; returns the status code, or -1.
+        // headers are extra header lines, each ending in \r\n
+        int Send(const std::string &method, const std::string &target, const std::string &body,
+                 std::string *responseBody = nullptr, const std::string &headers = "") {
+            // a kept alive connection closed by the server is opened again once, unless the request may
+            // have reached the server: one that is not idempotent would be done twice
+            bool idempotent = method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE";
+            for (int attempt = 0; attempt < 2; attempt++) {
+                bool reused = fd != -1;
+                if (! reused && ! Open())
+                    return -1;
+                int status = Exchange(method, target, body, responseBody, headers);
+                if (status != -1)
+                    return status;
+                Close();
+                if (! reused || received || (sent && ! idempotent))
+                    return -1;
+            }
+            return -1;
+        }
+
+        // The value of a header of the last response ("" if it had none)
+        std::string HeaderOf(const std::string &name) const {
+            std::string lower = name;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            size_t found = lowerHead.find("\r\n" + lower + ":");
+            if (found == std::string::npos)
+                return "";
+            size_t start = head.find_first_not_of(' ', found + lower.size() + 3);
+            size_t end = head.find("\r\n", found + 2);
+            return start < end ? head.substr(start, end - start) : "";
+        }
+
+    private:
+        bool Open() {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+                return false;
+
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd == -1)
+                return false;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            // a server that stopped answering does not block the caller forever
+            struct timeval tv = {timeout, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            if (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+                Close();
+                return false;
+            }
+            return true;
+        }
+
+        void Close() {
+            if (fd != -1)
+                close(fd);
+            fd = -1;
+            buffer.clear();
+        }
+
+        int Exchange(const std::string &method, const std::string &target, const std::string &body,
+                     std::string *responseBody, const std::string &headers) {
+            std::string request = method + " " + target + " HTTP/1.1\r\nHost: " + host + "\r\n" + headers +
+                                  "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            sent = received = false;
+            for (size_t done = 0; done < request.size(); ) {
+                ssize_t n = send(fd, request.data() + done, request.size() - done, MSG_NOSIGNAL);
+                if (n <= 0)
+                    return -1;
+                sent = true;
+                done += n;
+            }
+
+            size_t end;
+            while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+                if (! Receive())
+                    return -1;
+            }
+            head = buffer.substr(0, end + 2);
+            buffer.erase(0, end + 4);
+
+            int status = -1;
+            if (head.compare(0, 5, "HTTP/") == 0 && head.size() > 12)
+                status = atoi(head.c_str() + 9);
+
+            lowerHead = head;
+            std::transform(lowerHead.begin(), lowerHead.end(), lowerHead.begin(), ::tolower);
+            size_t length = 0;
+            size_t found = lowerHead.find("content-length:");
+            if (found != std::string::npos)
+                length = strtoul(lowerHead.c_str() + found + 15, nullptr, 10);
+            while (buffer.size() < length) {
+                if (! Receive())
+                    return -1;
+            }
+            if (responseBody)
+                *responseBody = buffer.substr(0, length);
+            buffer.erase(0, length);
+
+            if (lowerHead.find("connection: close") != std::string::npos)
+                Close();
+            return status;
+        }
+
+        bool Receive() {
+            char chunk[16384];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return false;
+            received = true;
+            buffer.append(chunk, n);
+            return true;
+        }
+
+        std::string host;
+        int port;
+        int timeout;
+        int fd = -1;
+        std::string buffer;
+        std::string head, lowerHead;    // of the last response
+        bool sent = false, received = false;    // whether any byte of the last exchange went out, came in
+    };
+}
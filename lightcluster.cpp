@@ -0,0 +1,196 @@
+// Cluster mode: the lights are partitioned across several servers by consistent
+// hashing of their ids. A server receiving a request for a light it does not own
+// forwards it to the owner over a persistent connection.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LightCluster {
+
+    // Header marking a request forwarded by another server (it is never forwarded again)
+    static const char* ForwardedHeader = "X-SmartLight-Forwarded";
+    // Header carrying the address of the client of a forwarded request (for the rate limits)
+    static const char* ClientHeader = "X-SmartLight-Client";
+    // Header carrying the secret shared by the members; the two headers above and the /cluster
+    // changes are only taken from the requests that have it
+    static const char* SecretHeader = "X-SmartLight-Secret";
+
+    // Compare a secret in a time that does not depend on where it differs
+    inline bool SameSecret(const std::string &given, const std::string &secret) {
+        if (given.size() != secret.size())
+            return false;
+        unsigned char difference = 0;
+        for (size_t i = 0; i < secret.size(); i++)
+            difference |= given[i] ^ secret[i];
+        return difference == 0;
+    }
+
+    // FNV-1a followed by a 64 bit mix, so close names land far apart on the ring
+    inline uint64_t Hash(const std::string &key) {
+        uint64_t h = 1469598103934665603ULL;
+        for (unsigned char c: key) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // "host:port" -> host and port; false if it is not one
+    inline bool ParseNode(const std::string &node, std::string &host, int &port) {
+        size_t colon = node.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+            return false;
+        host = node.substr(0, colon);
+        port = atoi(node.c_str() + colon + 1);
+        return 0 < port && port < 65536;
+    }
+
+    // Consistent hashing ring; every node is placed on it VirtualNodes times so the
+    // lights are spread evenly and a joining node takes lights from all the others
+    class Ring {
+    public:
+        static const int VirtualNodes = 64;
+
+        explicit Ring(std::vector<std::string> nodes) {
+            std::sort(nodes.begin(), nodes.end());
+            nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+            this->nodes = nodes;
+            for (int n = 0; n < (int) nodes.size(); n++) {
+                for (int v = 0; v < VirtualNodes; v++)
+                    points.push_back({Hash(nodes[n] + "#" + std::to_string(v)), n});
+            }
+            std::sort(points.begin(), points.end());
+        }
+
+        const std::vector<std::string>& Nodes() const {
+            return this->nodes;
+        }
+
+        bool Contains(const std::string &node) const {
+            return std::binary_search(nodes.begin(), nodes.end(), node);
+        }
+
+        // The node owning a light: the first point of the ring after the hash of the id
+        const std::string& Owner(int id) const {
+            static const std::string none = "";
+            if (points.empty())
+                return none;
+            uint64_t h = Hash("light:" + std::to_string(id));
+            auto found = std::lower_bound(points.begin(), points.end(), std::make_pair(h, 0));
+            if (found == points.end())
+                found = points.begin();
+            return nodes[found->second];
+        }
+
+    private:
+        std::vector<std::string> nodes;
+        std::vector<std::pair<uint64_t, int>> points;
+    };
+
+    // The headers of a response that are relayed to the client a request was forwarded for
+    static const char* const RelayedHeaders[] = {"ETag", "Retry-After"};
+    using Headers = std::vector<std::pair<std::string, std::string>>;
+
+    // Called with the status (-1 if the node could not be reached), the body and the relayed headers of the response
+    using Callback = std::function<void(int status, const std::string& body, const Headers& headers)>;
+
+    // Workers sending the requests to the other nodes, each over its own persistent
+    // connections. The requests for a light always go through the same worker, in order.
+    class Forwarder {
+    public:
+        explicit Forwarder(int nrWorkers = 4) {
+            queues.resize(std::max(1, nrWorkers));
+            for (size_t i = 0; i < queues.size(); i++)
+                workers.emplace_back(&Forwarder::Work, this, i);
+        }
+
+        ~Forwarder() {
+            Stop();
+        }
+
+        void Forward(int light, const std::string &node, const std::string &method, const std::string &target,
+                     const std::string &body, const std::string &headers, Callback callback) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (! stopping) {
+                    size_t index = (light >= 0 ? light : std::hash<std::string>()(target)) % queues.size();
+                    queues[index].push_back({node, method, target, body, headers, callback});
+                    wakeup.notify_all();
+                    return;
+                }
+            }
+            callback(-1, "The server is shutting down\n", {});
+        }
+
+        // Send what was submitted, then stop the workers
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (stopping)
+                    return;
+                stopping = true;
+                wakeup.notify_all();
+            }
+            for (std::thread &t: workers)
+                t.join();
+        }
+
+    private:
+        struct Job {
+            std::string node, method, target, body, headers;
+            Callback callback;
+        };
+
+        void Work(size_t index) {
+            std::map<std::string, std::unique_ptr<LightClient::Connection>> connections;
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                wakeup.wait(guard, [&] { return stopping || ! queues[index].empty(); });
+                if (queues[index].empty())
+                    return;
+                Job job = queues[index].front();
+                queues[index].pop_front();
+                guard.unlock();
+
+                int status = -1;
+                std::string body;
+                Headers headers;
+                std::string host;
+                int port;
+                if (ParseNode(job.node, host, port)) {
+                    auto &connection = connections[job.node];
+                    if (! connection)
+                        connection.reset(new LightClient::Connection(host, port));
+                    status = connection->Send(job.method, job.target, job.body, &body, job.headers);
+                    for (const char *name: RelayedHeaders) {
+                        std::string value = connection->HeaderOf(name);
+                        if (! value.empty())
+                            headers.push_back({name, value});
+                    }
+                }
+                job.callback(status, body, headers);
+
+                guard.lock();
+            }
+        }
+
+        std::mutex lock;
+        std::condition_variable wakeup;
+        std::vector<std::deque<Job>> queues;
+        std::vector<std::thread> workers;
+        bool stopping = false;
+    };
+}
@@ -0,0 +1,164 @@
+// Conversion of the abstract light settings (temperature, luminosity, RGB, manual)
+// into the final values sent to the devices.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace LightColor {
+
+    // Lights are converted in groups of this size (one 128 bit register of uint16_t)
+    static const int Lanes = 8;
+
+    // temperature 0 is the warmest white, temperature 100 the coldest one
+    static const double MinKelvin = 2700.0;
+    static const double MaxKelvin = 6500.0;
+    static const double Gamma     = 2.2;
+
+    // All the factors below are on a 0..255 scale where 255 means 1.0
+    struct Tables {
+        uint8_t white[101][3];   // white point of every temperature step (R, G, B)
+        uint8_t luminosity[101]; // perceptual (gamma corrected) brightness of every luminosity step
+
+        Tables() {
+            for (int t = 0; t <= 100; t++) {
+                double kelvin = MinKelvin + (MaxKelvin - MinKelvin) * t / 100.0;
+                double r, g, b;
+                KelvinToRGB(kelvin, r, g, b);
+                // normalize so the strongest channel stays at full intensity
+                double m = std::max(r, std::max(g, b));
+                white[t][0] = (uint8_t) std::lround(255.0 * r / m);
+                white[t][1] = (uint8_t) std::lround(255.0 * g / m);
+                white[t][2] = (uint8_t) std::lround(255.0 * b / m);
+            }
+            for (int l = 0; l <= 100; l++) {
+                luminosity[l] = (uint8_t) std::lround(255.0 * std::pow(l / 100.0, Gamma));
+            }
+        }
+
+    private:
+        // Tanner Helland's approximation of the black body color, valid for 1000K - 40000K
+        static void KelvinToRGB(double kelvin, double &r, double &g, double &b) {
+            double t = kelvin / 100.0;
+            if (t <= 66) {
+                r = 255;
+                g = 99.4708025861 * std::log(t) - 161.1195681661;
+                b = (t <= 19) ? 0 : 138.5177312231 * std::log(t - 10) - 305.0447927307;
+            } else {
+                r = 329.698727446 * std::pow(t - 60, -0.1332047592);
+                g = 288.1221695283 * std::pow(t - 60, -0.0755148492);
+                b = 255;
+            }
+            r = std::min(255.0, std::max(0.0, r));
+            g = std::min(255.0, std::max(0.0, g));
+            b = std::min(255.0, std::max(0.0, b));
+        }
+    };
+
+    const Tables& GetTables() {
+        static const Tables tables;
+        return tables;
+    }
+
+    // x * y / 255, rounded, for x, y in 0..255 (exact, no division)
+    inline uint16_t Mul255(uint16_t x, uint16_t y) {
+        uint16_t t = x * y + 128;
+        return (t + (t >> 8)) >> 8;
+    }
+
+    // The input of a single light, as read from the SmartLight table
+    struct Input {
+        bool powered;
+        int R, G, B, luminosity, temperature;
+    };
+
+    // Structure of arrays holding the whole light table, padded to a multiple of Lanes.
+    // Only the groups that contain a dirty light are converted again.
+    class Frame {
+    public:
+        explicit Frame(int nrLights)
+            : padded((nrLights + Lanes - 1) / Lanes * Lanes),
+              color(3 * padded, 0), factor(3 * padded, 0), scale(padded, 0),
+              output(3 * padded, 0), dirty(padded / Lanes, 0)
+        {}
+
+        // Load the new input of a light; it is scheduled for conversion only if it changed.
+        // The table lookups are done here so the conversion itself is pure arithmetic.
+        void Set(int id, const Input &in) {
+            const Tables &tables = GetTables();
+            int temperature = std::min(100, std::max(0, in.temperature));
+            int luminosity  = std::min(100, std::max(0, in.luminosity));
+            int channel[3]  = {in.R, in.G, in.B};
+            bool changed = false;
+
+            for (int c = 0; c < 3; c++) {
+                uint16_t value = (uint16_t) std::min(255, std::max(0, channel[c]));
+                // the temperature is applied whether the user or the sensors set it
+                uint16_t white = tables.white[temperature][c];
+                changed |= this->color[c * this->padded + id] != value || this->factor[c * this->padded + id] != white;
+                this->color[c * this->padded + id]  = value;
+                this->factor[c * this->padded + id] = white;
+            }
+            uint16_t lum = in.powered ? tables.luminosity[luminosity] : 0;
+            changed |= this->scale[id] != lum;
+            this->scale[id] = lum;
+
+            if (changed)
+                this->dirty[id / Lanes] |= 1 << (id % Lanes);
+        }
+
+        // Convert the lights id / Lanes == group, if any of them is dirty.
+        // Groups share no data, so different groups can be converted concurrently.
+        void Render(int group) {
+            if (! this->dirty[group])
+                return;
+            for (int c = 0; c < 3; c++) {
+                int offset = c * this->padded + group * Lanes;
+                RenderGroup(&this->color[offset], &this->factor[offset],
+                            &this->scale[group * Lanes], &this->output[offset]);
+            }
+            this->dirty[group] = 0;
+        }
+
+        void Get(int id, int &R, int &G, int &B) const {
+            R = this->output[0 * this->padded + id];
+            G = this->output[1 * this->padded + id];
+            B = this->output[2 * this->padded + id];
+        }
+
+    private:
+        // out = color * factor * scale, everything on the 0..255 scale
+        static void RenderGroup(const uint16_t *color, const uint16_t *factor,
+                                const uint16_t *scale, uint16_t *out) {
+#if defined(__SSE2__)
+            const __m128i half = _mm_set1_epi16(128);
+            __m128i c = _mm_loadu_si128((const __m128i *) color);
+            __m128i f = _mm_loadu_si128((const __m128i *) factor);
+            __m128i s = _mm_loadu_si128((const __m128i *) scale);
+
+            __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, f), half);
+            c = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+            t = _mm_add_epi16(_mm_mullo_epi16(c, s), half);
+            c = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+            _mm_storeu_si128((__m128i *) out, c);
+#else
+            for (int i = 0; i < Lanes; i++)
+                out[i] = Mul255(Mul255(color[i], factor[i]), scale[i]);
+#endif
+        }
+
+        int padded;
+        std::vector<uint16_t> color;  // R block, G block, B block
+        std::vector<uint16_t> factor; // white point of the temperature, same layout as color
+        std::vector<uint16_t> scale;  // luminosity, 0 when the light is not powered
+        std::vector<uint16_t> output; // same layout as color
+        std::vector<uint8_t>  dirty;  // one bit per light, one byte per group
+    };
+}
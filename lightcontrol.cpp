@@ -0,0 +1,494 @@
+// Control channel: persistent WebSocket connections carrying binary messages that set the
+// color and luminosity of lights, for interactive control (color wheels, live shows) at tens
+// of updates per second without a HTTP request per change. The changes of the lights (made by
+// any client, the HTTP API, the music or the automation) are pushed back on the same connections.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// Every binary message of a client holds one or more updates of 6 bytes:
+//   id (2 bytes, big endian), R, G, B, luminosity (0 to 100, 255 keeps the current one)
+// A luminosity switches an automatic light to manual, the sensors would override it otherwise.
+// and every message of the server one or more notifications of 10 bytes:
+//   id (2 bytes, big endian), R, G, B, luminosity, version (4 bytes, big endian, see the ETags)
+// A notification holds the latest state of a light: the changes a slow client could not
+// receive in time are merged into the next notification, they are never queued.
+//
+// Browsers send the Origin of the page opening a WebSocket: only the origins allowed by the
+// server are accepted, so the pages of other sites cannot drive the lights. Clients that are
+// not browsers send no Origin.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LightControl {
+
+    static const size_t UpdateSize = 6;
+    static const size_t NotificationSize = 10;
+    static const uint8_t KeepLuminosity = 255;
+    static const size_t MaxHandshake = 8192;
+    static const size_t MaxMessage = 1 << 16;   // a bigger message closes the connection
+    static const size_t MaxPending = 1 << 16;   // output of a slow client before its notifications wait
+    static const size_t MaxConnections = 256;
+
+    enum Opcode : uint8_t {
+        Continuation = 0x0,
+        Text = 0x1,
+        Binary = 0x2,
+        Close = 0x8,
+        Ping = 0x9,
+        Pong = 0xA
+    };
+
+    struct Update {
+        int id;
+        uint8_t R, G, B, luminosity;
+    };
+
+    struct State {
+        uint8_t R, G, B, luminosity;
+        uint32_t version;
+    };
+
+    // Apply the updates of a message, in order
+    using Apply = std::function<void(const std::vector<Update>& updates)>;
+    // The state of a light; false if it has none to tell (not init)
+    using Read = std::function<bool(int id, State& state)>;
+
+    // The Sec-WebSocket-Accept answering a Sec-WebSocket-Key (RFC 6455)
+    inline std::string AcceptOf(const std::string &key) {
+        std::string text = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_Digest(text.data(), text.size(), digest, &length, EVP_sha1(), nullptr);
+        unsigned char encoded[4 * ((EVP_MAX_MD_SIZE + 2) / 3) + 1];
+        int size = EVP_EncodeBlock(encoded, digest, (int) length);
+        return std::string((char *) encoded, size);
+    }
+
+    // The header of a frame of the server (never masked)
+    inline std::string FrameOf(Opcode opcode, size_t length) {
+        std::string head(1, (char) (0x80 | opcode));
+        if (length < 126)
+            head += (char) length;
+        else if (length < 65536) {
+            head += (char) 126;
+            head += (char) (length >> 8);
+            head += (char) length;
+        } else {
+            head += (char) 127;
+            for (int shift = 56; shift >= 0; shift -= 8)
+                head += (char) (length >> shift);
+        }
+        return head;
+    }
+
+    // The value of a header of a HTTP request head ("" if it has none)
+    inline std::string HeaderOf(const std::string &head, const std::string &name) {
+        std::string lower = head;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        size_t found = lower.find("\r\n" + name + ":");
+        if (found == std::string::npos)
+            return "";
+        size_t start = head.find_first_not_of(" \t", found + name.size() + 3);
+        size_t end = head.find("\r\n", found + 2);
+        if (start >= end)
+            return "";
+        size_t last = head.find_last_not_of(" \t", end - 1);
+        return head.substr(start, last + 1 - start);
+    }
+
+    // Whether a header value (a list separated by commas) has token, in any case
+    inline bool HasToken(std::string value, const std::string &token) {
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        for (size_t start = 0, end; start < value.size(); start = end + 1) {
+            end = std::min(value.find(',', start), value.size());
+            size_t first = value.find_first_not_of(" \t", start);
+            size_t last = value.find_last_not_of(" \t", end - 1);
+            if (first < end && value.compare(first, last + 1 - first, token) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // One thread serving all the connections of the channel through epoll
+    class Server {
+    public:
+        // origins are the Origin headers accepted (the pages allowed to connect from a browser)
+        Server(int nrLights, Apply apply, Read read, std::vector<std::string> origins = {})
+            : nrLights(nrLights), apply(apply), read(read), origins(origins) {}
+
+        ~Server() {
+            Stop();
+            for (int fd: {listener, epollFd, wakeFd}) {
+                if (fd != -1)
+                    close(fd);
+            }
+        }
+
+        Server(const Server&) = delete;
+        Server& operator= (const Server&) = delete;
+
+        // Listen on port; throws a message if it cannot. reusePort shares the port with the server
+        // being replaced (hot restart), like the HTTP listeners; a second server started on the port
+        // by mistake fails otherwise instead of taking part of the connections.
+        void Start(int port, bool reusePort = false) {
+            listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listener == -1)
+                throw "The control channel could not be opened";
+            int one = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (reusePort)
+                setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(port);
+            if (bind(listener, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 128) != 0)
+                throw "The control channel could not listen on its port";
+
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epollFd == -1 || wakeFd == -1)
+                throw "The control channel could not be started";
+            Watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+            Watch(wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+            worker = std::thread(&Server::Run, this);
+        }
+
+        // Some light changed: push the changes to the clients.
+        // Cheap enough to be called while holding the lock of the light.
+        void Changed() {
+            if (wakeFd != -1 && ! pending.exchange(true))
+                Wake();
+        }
+
+        // Close the connections and the port (the server taking over listens on it) and stop the thread
+        void Stop() {
+            if (! worker.joinable())
+                return;
+            stopping = true;
+            Wake();
+            worker.join();
+            for (auto &entry: connections)
+                close(entry.first);
+            connections.clear();
+            close(listener);
+            listener = -1;
+        }
+
+    private:
+        struct Connection {
+            bool open = false;          // after the handshake
+            bool closing = false;       // closed once its output is sent
+            bool writable = false;      // waiting for the socket to take more output
+            std::string in, out;
+            std::string message;        // the payload of the frames of the current message
+            std::vector<int64_t> sent;  // the version of every light last sent (-1 none)
+        };
+
+        void Wake() {
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                printError("The control channel could not be woken up");
+        }
+
+        void Watch(int fd, uint32_t events, int operation) {
+            epoll_event event = {};
+            event.events = events;
+            event.data.fd = fd;
+            epoll_ctl(epollFd, operation, fd, &event);
+        }
+
+        void Run() {
+            epoll_event events[64];
+            while (! stopping) {
+                int n = epoll_wait(epollFd, events, 64, -1);
+                bool notify = false;
+                for (int i = 0; i < n; i++) {
+                    int fd = events[i].data.fd;
+                    if (fd == listener) {
+                        Accept();
+                        continue;
+                    }
+                    if (fd == wakeFd) {
+                        uint64_t count;
+                        if (::read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                            printError("The control channel could not be woken up");
+                        // the changes made from now on wake the thread again
+                        pending = false;
+                        notify = true;
+                        continue;
+                    }
+                    auto found = connections.find(fd);
+                    if (found == connections.end())
+                        continue;
+                    Connection &connection = found->second;
+                    bool keep = true;
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                        keep = Receive(fd, connection, notify);
+                    if (keep && (events[i].events & EPOLLOUT)) {
+                        keep = Flush(fd, connection);
+                        // the notifications held back by a full output can be sent
+                        notify = true;
+                    }
+                    if (! keep)
+                        Drop(fd);
+                }
+                if (notify)
+                    Notify();
+            }
+        }
+
+        void Accept() {
+            while (true) {
+                int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1)
+                    return;
+                if (connections.size() >= MaxConnections) {
+                    close(fd);
+                    continue;
+                }
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                connections[fd].sent.assign(nrLights, -1);
+                Watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            }
+        }
+
+        void Drop(int fd) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            connections.erase(fd);
+        }
+
+        // The status line and headers refusing an opening handshake (RFC 6455 4.2.1), "" if it is accepted
+        std::string Refusal(const std::string &head) {
+            std::string origin = HeaderOf(head, "origin");
+            if (head.compare(0, 4, "GET ") != 0 || head.find(" HTTP/1.1\r\n") == std::string::npos ||
+                    ! HasToken(HeaderOf(head, "upgrade"), "websocket") ||
+                    ! HasToken(HeaderOf(head, "connection"), "upgrade") ||
+                    HeaderOf(head, "sec-websocket-key").size() != 24)
+                return "400 Bad Request";
+            if (HeaderOf(head, "sec-websocket-version") != "13")
+                return "426 Upgrade Required\r\nSec-WebSocket-Version: 13";
+            if (! origin.empty() && std::find(origins.begin(), origins.end(), origin) == origins.end())
+                return "403 Forbidden";
+            return "";
+        }
+
+        // Read what arrived and handle the complete frames; false if the connection is to be dropped
+        bool Receive(int fd, Connection &connection, bool &notify) {
+            char chunk[16384];
+            while (true) {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n > 0) {
+                    connection.in.append(chunk, n);
+                    continue;
+                }
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    return false;
+                if (errno != EINTR)
+                    break;
+            }
+            if (connection.closing) {
+                connection.in.clear();
+                return true;
+            }
+
+            if (! connection.open) {
+                size_t end = connection.in.find("\r\n\r\n");
+                if (end == std::string::npos)
+                    return connection.in.size() < MaxHandshake;
+                std::string head = connection.in.substr(0, end + 2);
+                connection.in.erase(0, end + 4);
+                std::string refused = Refusal(head);
+                if (! refused.empty()) {
+                    connection.out += "HTTP/1.1 " + refused + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                    connection.closing = true;
+                    return Flush(fd, connection);
+                }
+                std::string key = HeaderOf(head, "sec-websocket-key");
+                connection.out += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                  "Sec-WebSocket-Accept: " + AcceptOf(key) + "\r\n\r\n";
+                connection.open = true;
+                // a new client gets the state of every light first
+                notify = true;
+            }
+
+            size_t at = 0;
+            const std::string &in = connection.in;
+            while (! connection.closing && in.size() - at >= 2) {
+                uint8_t first = in[at], second = in[at + 1];
+                bool last = first & 0x80;
+                Opcode opcode = (Opcode) (first & 0x0f);
+                uint64_t length = second & 0x7f;
+                size_t offset = 2;
+                if (length == 126) {
+                    if (in.size() - at < 4)
+                        break;
+                    length = (uint8_t) in[at + 2] << 8 | (uint8_t) in[at + 3];
+                    offset = 4;
+                } else if (length == 127) {
+                    if (in.size() - at < 10)
+                        break;
+                    length = 0;
+                    for (int i = 0; i < 8; i++)
+                        length = length << 8 | (uint8_t) in[at + 2 + i];
+                    offset = 10;
+                }
+                // the frames of the clients must be masked
+                if (! (second & 0x80)) {
+                    CloseWith(connection, 1002);
+                    break;
+                }
+                if (length > MaxMessage) {
+                    CloseWith(connection, 1009);
+                    break;
+                }
+                if (in.size() - at < offset + 4 + length)
+                    break;
+
+                const char *mask = in.data() + at + offset;
+                std::string payload = in.substr(at + offset + 4, length);
+                for (size_t i = 0; i < payload.size(); i++)
+                    payload[i] ^= mask[i % 4];
+                at += offset + 4 + length;
+
+                switch (opcode) {
+                    case Continuation:
+                    case Binary:
+                        connection.message += payload;
+                        if (connection.message.size() > MaxMessage)
+                            CloseWith(connection, 1009);
+                        else if (last) {
+                            if (! Decode(connection.message))
+                                CloseWith(connection, 1007);
+                            connection.message.clear();
+                        }
+                        break;
+                    case Ping:
+                        connection.out += FrameOf(Pong, payload.size()) + payload;
+                        break;
+                    case Pong:
+                        break;
+                    case Close:
+                        connection.out += FrameOf(Close, std::min<size_t>(2, payload.size())) + payload.substr(0, 2);
+                        connection.closing = true;
+                        break;
+                    case Text:
+                        CloseWith(connection, 1003);
+                        break;
+                    default:
+                        CloseWith(connection, 1002);
+                }
+            }
+            connection.in.erase(0, at);
+            return Flush(fd, connection);
+        }
+
+        // Apply the updates of a message; false if it is not made of whole updates
+        bool Decode(const std::string &message) {
+            if (message.empty() || message.size() % UpdateSize != 0)
+                return false;
+            std::vector<Update> updates(message.size() / UpdateSize);
+            for (size_t i = 0; i < updates.size(); i++) {
+                const uint8_t *record = (const uint8_t *) message.data() + i * UpdateSize;
+                updates[i] = {record[0] << 8 | record[1], record[2], record[3], record[4], record[5]};
+            }
+            apply(updates);
+            return true;
+        }
+
+        void CloseWith(Connection &connection, uint16_t code) {
+            std::string payload = {(char) (code >> 8), (char) code};
+            connection.out += FrameOf(Close, payload.size()) + payload;
+            connection.closing = true;
+        }
+
+        // Send what the socket takes now, the rest once it is writable;
+        // false if the connection is to be dropped (broken, or closed and sent)
+        bool Flush(int fd, Connection &connection) {
+            while (! connection.out.empty()) {
+                ssize_t n = send(fd, connection.out.data(), connection.out.size(), MSG_NOSIGNAL);
+                if (n > 0) {
+                    connection.out.erase(0, n);
+                    continue;
+                }
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    if (! connection.writable)
+                        Watch(fd, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+                    connection.writable = true;
+                    // a client that reads nothing is not kept forever
+                    return connection.out.size() < 4 * MaxPending;
+                }
+                return false;
+            }
+            if (connection.writable)
+                Watch(fd, EPOLLIN, EPOLL_CTL_MOD);
+            connection.writable = false;
+            return ! connection.closing;
+        }
+
+        // Send the lights changed since their last notification to every client that can take them
+        void Notify() {
+            std::vector<State> states(nrLights);
+            std::vector<bool> known;
+            std::vector<int> dropped;
+            for (auto &entry: connections) {
+                Connection &connection = entry.second;
+                if (! connection.open || connection.closing || connection.out.size() >= MaxPending)
+                    continue;
+                if (known.empty()) {
+                    known.resize(nrLights);
+                    for (int id = 0; id < nrLights; id++)
+                        known[id] = read(id, states[id]);
+                }
+                std::string payload;
+                for (int id = 0; id < nrLights; id++) {
+                    if (! known[id] || connection.sent[id] == states[id].version)
+                        continue;
+                    const State &state = states[id];
+                    char record[NotificationSize] = {(char) (id >> 8), (char) id, (char) state.R, (char) state.G,
+                                                     (char) state.B, (char) state.luminosity,
+                                                     (char) (state.version >> 24), (char) (state.version >> 16),
+                                                     (char) (state.version >> 8), (char) state.version};
+                    payload.append(record, NotificationSize);
+                    connection.sent[id] = state.version;
+                }
+                if (payload.empty())
+                    continue;
+                connection.out += FrameOf(Binary, payload.size()) + payload;
+                if (! Flush(entry.first, connection))
+                    dropped.push_back(entry.first);
+            }
+            for (int fd: dropped)
+                Drop(fd);
+        }
+
+        int nrLights;
+        Apply apply;
+        Read read;
+        std::vector<std::string> origins;
+        int listener = -1, epollFd = -1, wakeFd = -1;
+        std::atomic<bool> pending{false};
+        std::atomic<bool> stopping{false};
+        std::thread worker;
+        std::map<int, Connection> connections;   // by socket, only used by the worker
+    };
+}
@@ -0,0 +1,317 @@
+// DMX over UDP: the frames of lighting consoles, in E1.31 (sACN) or Art-Net (ArtDmx) packets,
+// set the color and luminosity of the lights patched on their universes. One thread takes the
+// packets in batches (recvmmsg), keeps the last frame of every universe of the batch and applies
+// it in one pass, changing only the lights whose channels changed since the previous frame
+// (consoles send every universe about 44 times a second, changed or not).
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// Patch format (see dmx_patch_sample.json):
+//   {"sacn": 5568, "artnet": 6454,                     (0 to not listen to a protocol)
+//    "lights": [{"id": 0, "universe": 1, "address": 1},                     R, G, B
+//               {"id": 1, "universe": 1, "address": 4, "luminosity": true}]} R, G, B, dimmer
+// The addresses start at 1. The Art-Net universe is its 15 bit port address. The sACN
+// multicast groups of the patched universes are joined, unicast packets are taken as well.
+// A light with a dimmer is switched to manual by its frames, the sensors would override it otherwise.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LightDmx {
+
+    static const int Channels = 512;
+    static const int Batch = 64;            // packets taken by one recvmmsg
+    static const int PacketSize = 638;      // the biggest E1.31 data packet
+    static const size_t MaxSources = 16;    // sources whose sequence is kept per universe
+
+    struct Patch {
+        int light;
+        int universe;
+        int address;        // of the first channel, from 0
+        bool luminosity;    // a dimmer channel after R, G and B
+    };
+
+    // The DMX values of a light
+    struct Change {
+        int light;
+        uint8_t R, G, B;
+        int luminosity;     // 0 to 100, -1 if not patched
+    };
+
+    using Apply = std::function<void(const std::vector<Change>& changes)>;
+
+    // A frame of a universe
+    struct Frame {
+        int universe;
+        uint8_t sequence;   // in Art-Net, 0 if the source does not number its frames
+        int length;
+        const uint8_t *data;
+        const uint8_t *cid; // the component identifier of the source (E1.31), nullptr in Art-Net
+    };
+
+    inline int Word(const uint8_t *at) {
+        return at[0] << 8 | at[1];
+    }
+
+    // An E1.31 data packet (ANSI E1.31-2018): false if it is another packet, preview data,
+    // the end of a stream or not DMX (a start code other than 0)
+    inline bool ParseE131(const uint8_t *packet, size_t size, Frame &frame) {
+        static const uint8_t Identifier[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+        if (size < 126 || Word(packet) != 0x0010 || memcmp(packet + 4, Identifier, 12) != 0)
+            return false;
+        // root vector VECTOR_ROOT_E131_DATA, framing vector VECTOR_E131_DATA_PACKET, DMP set property
+        if (Word(packet + 18) != 0 || Word(packet + 20) != 4 || Word(packet + 40) != 0 || Word(packet + 42) != 2 ||
+                packet[117] != 2 || packet[118] != 0xa1)
+            return false;
+        uint8_t options = packet[112];
+        if (options & 0xc0)
+            return false;
+        int count = Word(packet + 123);
+        if (count < 1 || packet[125] != 0 || 125 + (size_t) count > size)
+            return false;
+        frame.universe = Word(packet + 113);
+        frame.sequence = packet[111];
+        frame.length = std::min(count - 1, Channels);
+        frame.data = packet + 126;
+        frame.cid = packet + 22;
+        return true;
+    }
+
+    // An ArtDmx packet (Art-Net 4): false if it is another packet
+    inline bool ParseArtNet(const uint8_t *packet, size_t size, Frame &frame) {
+        static const uint8_t Identifier[8] = {'A', 'r', 't', '-', 'N', 'e', 't', 0};
+        if (size < 18 || memcmp(packet, Identifier, 8) != 0 || packet[8] != 0x00 || packet[9] != 0x50)
+            return false;
+        int length = Word(packet + 16);
+        if (length < 2 || length > Channels || 18 + (size_t) length > size)
+            return false;
+        frame.universe = (packet[15] & 0x7f) << 8 | packet[14];
+        frame.sequence = packet[12];
+        frame.length = length;
+        frame.data = packet + 18;
+        frame.cid = nullptr;
+        return true;
+    }
+
+    class Receiver {
+    public:
+        // Check the patch; throws a message if it is not valid
+        Receiver(const json &patch, int nrLights, Apply apply) : apply(apply) {
+            sacnPort = patch.value("sacn", 5568);
+            artnetPort = patch.value("artnet", 6454);
+            if (! patch.contains("lights") || ! patch["lights"].is_array())
+                throw "The DMX patch has no lights";
+            for (const json &light: patch["lights"]) {
+                Patch p;
+                p.light = light.at("id").get<int>();
+                p.universe = light.at("universe").get<int>();
+                p.address = light.at("address").get<int>() - 1;
+                p.luminosity = light.value("luminosity", false);
+                if (p.light < 0 || p.light >= nrLights)
+                    throw "The DMX patch has a light that is unavailable";
+                if (p.universe < 0 || p.universe > 63999)
+                    throw "The DMX patch has a universe that is not valid";
+                if (p.address < 0 || p.address + (p.luminosity ? 4 : 3) > Channels)
+                    throw "The DMX patch has channels out of their universe";
+                universes[p.universe].patches.push_back(p);
+            }
+        }
+
+        ~Receiver() {
+            Stop();
+            for (int fd: {sacn, artnet, wakeFd}) {
+                if (fd != -1)
+                    close(fd);
+            }
+        }
+
+        Receiver(const Receiver&) = delete;
+        Receiver& operator= (const Receiver&) = delete;
+
+        // Listen to the ports of the patch; throws a message if one cannot be opened.
+        // reusePort shares them with the server being replaced (hot restart): the kernel spreads the
+        // unicast packets over all the sockets of a port, a second server started by mistake fails instead.
+        void Start(bool reusePort = false) {
+            if (sacnPort)
+                sacn = Open(sacnPort, reusePort);
+            if (artnetPort)
+                artnet = Open(artnetPort, reusePort);
+            // the multicast group of a sACN universe is 239.255.<high byte>.<low byte>
+            for (auto &entry: universes) {
+                if (sacn == -1 || entry.first < 1)
+                    continue;
+                ip_mreq group = {};
+                group.imr_multiaddr.s_addr = htonl(0xefff0000 | entry.first);
+                group.imr_interface.s_addr = htonl(INADDR_ANY);
+                if (setsockopt(sacn, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) != 0)
+                    printWarn("The sACN universe " + std::to_string(entry.first) + " is only received by unicast");
+            }
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeFd == -1)
+                throw "The DMX receiver could not be started";
+            worker = std::thread(&Receiver::Run, this);
+        }
+
+        void Stop() {
+            if (! worker.joinable())
+                return;
+            stopping = true;
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) < 0)
+                printError("The DMX receiver could not be stopped");
+            worker.join();
+            // the server taking over receives every packet from now on
+            for (int *fd: {&sacn, &artnet}) {
+                if (*fd != -1)
+                    close(*fd);
+                *fd = -1;
+            }
+        }
+
+    private:
+        struct Universe {
+            std::vector<Patch> patches;
+            uint8_t values[Channels] = {};      // of the last frame applied
+            bool applied = false;
+            std::map<std::string, uint8_t> sequences;   // the last one of every source
+            // the last frame of the batch being handled
+            uint8_t batch[Channels];
+            int length = 0;
+            bool pending = false;
+        };
+
+        static int Open(int port, bool reusePort) {
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd == -1)
+                throw "The DMX port could not be opened";
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (reusePort)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+            // a burst of universes waits in the socket while a batch is applied
+            int buffer = 4 << 20;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(port);
+            if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+                close(fd);
+                throw "The DMX port could not be bound";
+            }
+            return fd;
+        }
+
+        void Run() {
+            std::vector<uint8_t> buffers(Batch * PacketSize);
+            mmsghdr messages[Batch];
+            iovec vectors[Batch];
+            sockaddr_in senders[Batch];
+            for (int i = 0; i < Batch; i++) {
+                vectors[i] = {buffers.data() + i * PacketSize, PacketSize};
+                messages[i] = {};
+                messages[i].msg_hdr.msg_iov = &vectors[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+                messages[i].msg_hdr.msg_name = &senders[i];
+            }
+
+            pollfd fds[3] = {{wakeFd, POLLIN, 0}, {sacn, POLLIN, 0}, {artnet, POLLIN, 0}};
+            while (! stopping) {
+                if (poll(fds, 3, -1) <= 0)
+                    continue;
+                for (int s = 1; s < 3; s++) {
+                    if (! (fds[s].revents & POLLIN))
+                        continue;
+                    // take the packets waiting, one batch at a time, until none is left
+                    int n;
+                    while (true) {
+                        for (int i = 0; i < Batch; i++)
+                            messages[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+                        if ((n = recvmmsg(fds[s].fd, messages, Batch, MSG_DONTWAIT, nullptr)) <= 0)
+                            break;
+                        for (int i = 0; i < n; i++)
+                            Take(buffers.data() + i * PacketSize, messages[i].msg_len, s == 1, senders[i]);
+                        ApplyBatch();
+                    }
+                }
+            }
+        }
+
+        // Keep the frame of a packet as the last of its universe in the batch
+        void Take(const uint8_t *packet, size_t size, bool e131, const sockaddr_in &sender) {
+            Frame frame;
+            if (! (e131 ? ParseE131(packet, size, frame) : ParseArtNet(packet, size, frame)))
+                return;
+            auto found = universes.find(frame.universe);
+            if (found == universes.end())
+                return;
+            Universe &universe = found->second;
+            // a frame arriving after a newer one of the same source is dropped (E1.31 6.7.2): the sources
+            // (a sACN one by its CID, an Art-Net one by its address) number their frames independently
+            std::string source = e131 ? "sacn:" + std::string((const char *) frame.cid, 16)
+                                      : "artnet:" + std::string((const char *) &sender.sin_addr, sizeof(sender.sin_addr)) +
+                                        std::string((const char *) &sender.sin_port, sizeof(sender.sin_port));
+            auto known = universe.sequences.find(source);
+            if (known != universe.sequences.end()) {
+                // 0 is not numbered in Art-Net, in E1.31 it is the number after 255
+                int8_t age = (int8_t) (frame.sequence - known->second);
+                bool numbered = frame.cid || (frame.sequence && known->second);
+                if (numbered && age <= 0 && age > -20)
+                    return;
+                known->second = frame.sequence;
+            } else {
+                // sources come and go (a console restarted gets a new port): the ones of the past are forgotten
+                if (universe.sequences.size() >= MaxSources)
+                    universe.sequences.clear();
+                universe.sequences[source] = frame.sequence;
+            }
+            memcpy(universe.batch, frame.data, frame.length);
+            universe.length = frame.length;
+            universe.pending = true;
+        }
+
+        // Apply the universes of the batch in one pass, only the lights whose channels changed
+        void ApplyBatch() {
+            changes.clear();
+            for (auto &entry: universes) {
+                Universe &universe = entry.second;
+                if (! universe.pending)
+                    continue;
+                universe.pending = false;
+                // the channels a short frame does not have are 0
+                memset(universe.batch + universe.length, 0, Channels - universe.length);
+                for (const Patch &patch: universe.patches) {
+                    int size = patch.luminosity ? 4 : 3;
+                    const uint8_t *values = universe.batch + patch.address;
+                    if (memcmp(values, universe.values + patch.address, size) == 0 && universe.applied)
+                        continue;
+                    changes.push_back({patch.light, values[0], values[1], values[2],
+                                       patch.luminosity ? (values[3] * 100 + 127) / 255 : -1});
+                }
+                memcpy(universe.values, universe.batch, Channels);
+                universe.applied = true;
+            }
+            if (! changes.empty())
+                apply(changes);
+        }
+
+        Apply apply;
+        int sacnPort, artnetPort;
+        int sacn = -1, artnet = -1, wakeFd = -1;
+        std::map<int, Universe> universes;     // the patched ones, only used by the worker once started
+        std::vector<Change> changes;
+        std::atomic<bool> stopping{false};
+        std::thread worker;
+    };
+}
@@ -0,0 +1,217 @@
+// History of every light: sensor samples, impact alerts and state changes,
+// kept in a memory mapped file with one fixed capacity ring per light.
+// Appending is lock free (one atomic increment and one record copy), so it
+// can be done from the MQTT thread and from the handlers holding a light lock.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LightHistory {
+
+    static const uint32_t Magic    = 0x534c4831; // "SLH1"
+    static const uint32_t Capacity = 4096;       // records kept per light
+    static const int      MaxPoints = 1000;      // buckets returned by a query at most
+    static const int64_t  MaxTime  = 1LL << 52;  // bound of the queried times (ms), far beyond any record
+
+    enum Kind : int32_t {
+        Sensor = 1, // values: s_luminosity, s_temperature
+        Impact = 2, // values: impact value
+        State  = 3  // values: R << 16 | G << 8 | B, luminosity, temperature, powered | manual << 1
+    };
+
+    struct Record {
+        // index + 1 of the record once it is completely written, so readers can
+        // tell a complete record from one being overwritten
+        std::atomic<uint64_t> seq;
+        int64_t time; // milliseconds since the epoch
+        int32_t kind;
+        int32_t values[4];
+    };
+
+    struct alignas(64) Ring {
+        std::atomic<uint64_t> head; // number of records ever appended
+        Record records[Capacity];
+    };
+
+    struct alignas(64) FileHeader {
+        uint32_t magic, capacity, nrLights;
+    };
+
+    // A downsampled bucket of a query
+    struct Bucket {
+        int64_t from, to;
+        int sensors = 0, impacts = 0, maxImpact = 0;
+        double sLuminosity = 0, sTemperature = 0; // averages
+        bool hasState = false;
+        int32_t state[4] = {0, 0, 0, 0};          // last state of the bucket
+    };
+
+    inline int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    class Store {
+    public:
+        // Nothing is kept until the history is opened (see Open)
+        explicit Store(int nrLights)
+            : nrLights(nrLights), size(sizeof(FileHeader) + nrLights * sizeof(Ring))
+        {}
+
+        /** Map the history of filepath, kept in memory only if the file cannot be used.
+         *  Opened once the server it replaces stopped appending to it (hot restart): a file of another
+         *  format or fleet size is replaced by a new one renamed over it, never truncated, as the old
+         *  server may still have it mapped.
+         **/
+        void Open(const char *filepath) {
+            try {
+                fd = open(filepath, O_RDWR | O_CREAT, (mode_t)0600);
+                if (fd == -1)
+                    throw "Error opening the file";
+
+                struct stat fileInfo = {0};
+                if (fstat(fd, &fileInfo) == -1)
+                    throw "Error getting the file size";
+
+                FileHeader header = {0, 0, 0};
+                bool same = fileInfo.st_size == (off_t) size &&
+                            pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                            header.magic == Magic && header.capacity == Capacity && header.nrLights == (uint32_t) nrLights;
+                if (! same) {
+                    // a history of another format or fleet size is dropped
+                    if (fileInfo.st_size != 0)
+                        Generic::printInfo((std::string) filepath + " has another format, the history starts over");
+                    close(fd);
+                    fd = -1;
+                    fd = Create(filepath);
+                }
+
+                map = (char *) mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED)
+                    throw "Error Mapping Failed";
+            } catch (char const* str) {
+                Generic::printError((std::string)"Error in creating the History Map (the history is kept in memory only):\n\t" + str);
+                if (fd != -1)
+                    close(fd);
+                fd = -1;
+                map = (char *) mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            }
+            rings = (Ring *) (map + sizeof(FileHeader));
+        }
+
+        ~Store() {
+            if (map != MAP_FAILED)
+                munmap(map, size);
+            if (fd != -1)
+                close(fd);
+        }
+
+        void Append(int id, Kind kind, int32_t v0, int32_t v1 = 0, int32_t v2 = 0, int32_t v3 = 0) {
+            if (id < 0 || id >= nrLights || map == MAP_FAILED)
+                return;
+            Ring &ring = rings[id];
+            uint64_t index = ring.head.fetch_add(1, std::memory_order_relaxed);
+            Record &record = ring.records[index % Capacity];
+
+            record.seq.store(0, std::memory_order_relaxed); // being written
+            std::atomic_thread_fence(std::memory_order_release);
+            record.time = Now();
+            record.kind = kind;
+            record.values[0] = v0;
+            record.values[1] = v1;
+            record.values[2] = v2;
+            record.values[3] = v3;
+            record.seq.store(index + 1, std::memory_order_release);
+        }
+
+        // Downsample the records of a light with from <= time < to into at most `points` buckets
+        std::vector<Bucket> Query(int id, int64_t from, int64_t to, int points) {
+            std::vector<Bucket> buckets;
+            points = std::min(points, MaxPoints);
+            // bounded, the arithmetic of the buckets cannot overflow
+            from = std::max(from, -MaxTime);
+            to   = std::min(to, MaxTime);
+            if (id < 0 || id >= nrLights || map == MAP_FAILED || to <= from || points <= 0)
+                return buckets;
+
+            int64_t width = std::max<int64_t>(1, (to - from + points - 1) / points);
+            for (int64_t start = from; start < to; start += width) {
+                Bucket bucket;
+                bucket.from = start;
+                bucket.to   = std::min(to, start + width);
+                buckets.push_back(bucket);
+            }
+
+            Ring &ring = rings[id];
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            uint64_t first = head > Capacity ? head - Capacity : 0;
+            for (uint64_t index = first; index < head; index++) {
+                Record &record = ring.records[index % Capacity];
+                if (record.seq.load(std::memory_order_acquire) != index + 1)
+                    continue; // being written or already overwritten
+                Record copy;
+                copy.time = record.time;
+                copy.kind = record.kind;
+                memcpy(copy.values, record.values, sizeof(copy.values));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (record.seq.load(std::memory_order_relaxed) != index + 1)
+                    continue; // overwritten while copied
+
+                if (copy.time < from || copy.time >= to)
+                    continue;
+                Bucket &bucket = buckets[(copy.time - from) / width];
+                switch (copy.kind) {
+                case Sensor:
+                    bucket.sensors++;
+                    bucket.sLuminosity  += (copy.values[0] - bucket.sLuminosity) / bucket.sensors;
+                    bucket.sTemperature += (copy.values[1] - bucket.sTemperature) / bucket.sensors;
+                    break;
+                case Impact:
+                    bucket.impacts++;
+                    bucket.maxImpact = std::max(bucket.maxImpact, (int) copy.values[0]);
+                    break;
+                case State:
+                    bucket.hasState = true;
+                    memcpy(bucket.state, copy.values, sizeof(bucket.state));
+                    break;
+                }
+            }
+            return buckets;
+        }
+
+    private:
+        // An empty history written aside then renamed over filepath; the descriptor of the new file
+        int Create(const char *filepath) {
+            std::string temporary = (std::string) filepath + ".new";
+            int created = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+            if (created == -1)
+                throw "Error creating the file";
+            FileHeader header = {Magic, Capacity, (uint32_t) nrLights};
+            if (ftruncate(created, size) == -1 ||
+                pwrite(created, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+                rename(temporary.c_str(), filepath) == -1) {
+                close(created);
+                unlink(temporary.c_str());
+                throw "Error creating the file";
+            }
+            return created;
+        }
+
+        int nrLights;
+        size_t size;
+        int fd = -1;
+        char *map = (char *) MAP_FAILED;
+        Ring *rings = nullptr;
+    };
+}
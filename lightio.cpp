@@ -0,0 +1,216 @@
+// Asynchronous file I/O for the request handlers: the handlers submit the work
+// and send their response from the completion callback, so a slow disk never
+// blocks the HTTP threads.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// By default the files are written by a small pool of threads. Compiled with
+// -DSMARTLIGHT_IO_URING (and linked with -luring) the writes go through io_uring.
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef SMARTLIGHT_IO_URING
+#include <liburing.h>
+#endif
+
+namespace LightIO {
+
+    // Called once the work is done; error is empty on success
+    using Callback = std::function<void(const std::string& error)>;
+
+    struct Job {
+        std::string path;
+        std::string data;
+        bool append;
+        Callback callback;
+    };
+
+    // Write the whole buffer with plain system calls; returns the error, if any
+    std::string WriteFile(const Job &job) {
+        int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | (job.append ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1)
+            return (std::string) "Error opening the file: " + strerror(errno);
+
+        std::string error;
+        size_t done = 0;
+        while (done < job.data.size()) {
+            ssize_t written = write(fd, job.data.data() + done, job.data.size() - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                error = (std::string) "Error writing the file: " + strerror(errno);
+                break;
+            }
+            done += written;
+        }
+        close(fd);
+        return error;
+    }
+
+    class Executor {
+    public:
+        explicit Executor(int nrThreads = 2) {
+#ifdef SMARTLIGHT_IO_URING
+            if (io_uring_queue_init(QueueDepth, &ring, 0) == 0) {
+                useRing = true;
+                nrThreads = 1; // one thread owns the ring
+            } else {
+                Generic::printWarn("io_uring is not available, using threads for the file I/O");
+            }
+#endif
+            queues.resize(std::max(1, nrThreads));
+            for (size_t i = 0; i < queues.size(); i++)
+                workers.emplace_back(&Executor::Work, this, i);
+        }
+
+        ~Executor() {
+            Stop();
+        }
+
+        // Write data to the file at path (replacing it, or at its end if append).
+        // The jobs for the same file are done in the order they were submitted.
+        void Write(const std::string &path, std::string data, bool append, Callback callback) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (! stopping) {
+                    queues[std::hash<std::string>()(path) % queues.size()].push_back({path, std::move(data), append, callback});
+                    wakeup.notify_all();
+                    return;
+                }
+            }
+            callback("The server is shutting down");
+        }
+
+        // Finish the submitted jobs, then stop the workers
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (stopping)
+                    return;
+                stopping = true;
+                wakeup.notify_all();
+            }
+            for (std::thread &t: workers)
+                t.join();
+#ifdef SMARTLIGHT_IO_URING
+            if (useRing)
+                io_uring_queue_exit(&ring);
+#endif
+        }
+
+    private:
+        void Work(size_t index) {
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                wakeup.wait(guard, [&] { return stopping || ! queues[index].empty(); });
+                if (queues[index].empty())
+                    return; // stopping, and nothing left to do
+
+                std::vector<Job> batch(std::make_move_iterator(queues[index].begin()),
+                                       std::make_move_iterator(queues[index].end()));
+                queues[index].clear();
+                guard.unlock();
+
+#ifdef SMARTLIGHT_IO_URING
+                if (useRing)
+                    RunRing(batch);
+                else
+#endif
+                for (Job &job: batch)
+                    job.callback(WriteFile(job));
+
+                guard.lock();
+            }
+        }
+
+#ifdef SMARTLIGHT_IO_URING
+        static const unsigned QueueDepth = 64;
+
+        // Submit the writes of a batch in rounds of one write per file: the writes to different files
+        // run together, a write waits in the batch until the previous one to its file completed, so
+        // the writes (and the truncations when the files are opened) of a file are done in order.
+        void RunRing(std::vector<Job> &batch) {
+            std::vector<bool> done(batch.size(), false);
+            for (size_t remaining = batch.size(); remaining > 0; ) {
+                std::vector<size_t> round;
+                std::set<std::string> paths;
+                for (size_t i = 0; i < batch.size() && round.size() < QueueDepth; i++) {
+                    if (! done[i] && paths.insert(batch[i].path).second)
+                        round.push_back(i);
+                }
+
+                std::vector<int> fds(round.size(), -1);
+                std::vector<std::string> errors(round.size());
+                unsigned submitted = 0;
+                for (size_t k = 0; k < round.size(); k++) {
+                    Job &job = batch[round[k]];
+                    fds[k] = open(job.path.c_str(), O_WRONLY | O_CREAT | (job.append ? O_APPEND : O_TRUNC), 0644);
+                    if (fds[k] == -1) {
+                        errors[k] = (std::string) "Error opening the file: " + strerror(errno);
+                        continue;
+                    }
+                    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+                    io_uring_prep_write(sqe, fds[k], job.data.data(), job.data.size(), 0);
+                    io_uring_sqe_set_data(sqe, (void *) k);
+                    submitted++;
+                }
+                io_uring_submit(&ring);
+
+                // a short write is finished synchronously below (this thread is not an HTTP one)
+                std::vector<size_t> written(round.size(), 0);
+                std::vector<bool> unfinished(round.size(), false);
+                for (unsigned i = 0; i < submitted; i++) {
+                    io_uring_cqe *cqe;
+                    if (io_uring_wait_cqe(&ring, &cqe) != 0)
+                        break;
+                    size_t k = (size_t) io_uring_cqe_get_data(cqe);
+                    if (cqe->res < 0) {
+                        errors[k] = (std::string) "Error writing the file: " + strerror(-cqe->res);
+                    } else if ((size_t) cqe->res < batch[round[k]].data.size()) {
+                        written[k] = cqe->res;
+                        unfinished[k] = true;
+                    }
+                    io_uring_cqe_seen(&ring, cqe);
+                }
+
+                for (size_t k = 0; k < round.size(); k++) {
+                    Job &job = batch[round[k]];
+                    if (fds[k] != -1)
+                        close(fds[k]);
+                    if (unfinished[k]) {
+                        job.data.erase(0, written[k]);
+                        job.append = true; // the file was already truncated when opened
+                        errors[k] = WriteFile(job);
+                    }
+                    job.callback(errors[k]);
+                    done[round[k]] = true;
+                    remaining--;
+                }
+            }
+        }
+
+        io_uring ring;
+        bool useRing = false;
+#endif
+
+        std::mutex lock;
+        std::condition_variable wakeup;
+        std::vector<std::deque<Job>> queues; // one queue per worker, chosen by the file path
+        std::vector<std::thread> workers;
+        bool stopping = false;
+    };
+}
@@ -0,0 +1,109 @@
+// Admission control: every request is checked here before its handler runs
+// (before any JSON parsing or light lock), and rejected right away when the
+// server, its client or the light it writes to is over its limit.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace LightLimit {
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Config {
+        double clientRate  = 50;  // requests per second of one client
+        double clientBurst = 100;
+        double lightRate   = 20;  // changes per second of one light
+        double lightBurst  = 40;
+        int    maxInFlight = 256; // requests handled at the same time by the whole server
+    };
+
+    // Classic token bucket: `rate` tokens per second, at most `burst` saved up
+    class alignas(64) TokenBucket {
+    public:
+        bool Take(double rate, double burst, Clock::time_point now) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (last == Clock::time_point()) {
+                tokens = burst;
+            } else {
+                double elapsed = std::chrono::duration<double>(now - last).count();
+                tokens = std::min(burst, tokens + elapsed * rate);
+            }
+            last = now;
+            if (tokens < 1)
+                return false;
+            tokens -= 1;
+            return true;
+        }
+
+    private:
+        std::mutex lock;
+        double tokens = 0;
+        Clock::time_point last;
+    };
+
+    enum class Verdict { Accepted, Overloaded, ClientLimited, LightLimited };
+
+    class Limiter {
+    public:
+        // The clients are hashed into a fixed table, so the memory does not grow with
+        // their number (clients sharing a slot share their limit)
+        static const int ClientSlots = 4096;
+
+        Limiter(int nrLights, Config config = Config())
+            : config(config), clients(ClientSlots), lights(nrLights)
+        {}
+
+        // Change the limits (before the server is started)
+        void Configure(const Config &config) {
+            this->config = config;
+        }
+
+        // Check a request of `client`; light is the id it changes, or -1.
+        // When accepted, the request counts as in flight until Release is called.
+        Verdict Admit(const std::string &client, int light) {
+            if (++this->inFlight > this->config.maxInFlight) {
+                --this->inFlight;
+                return Verdict::Overloaded;
+            }
+
+            Clock::time_point now = Clock::now();
+            Verdict verdict = Verdict::Accepted;
+            size_t slot = std::hash<std::string>()(client) % ClientSlots;
+            if (! this->clients[slot].Take(this->config.clientRate, this->config.clientBurst, now))
+                verdict = Verdict::ClientLimited;
+            else if (0 <= light && light < (int) this->lights.size() &&
+                     ! this->lights[light].Take(this->config.lightRate, this->config.lightBurst, now))
+                verdict = Verdict::LightLimited;
+
+            if (verdict != Verdict::Accepted)
+                --this->inFlight;
+            return verdict;
+        }
+
+        // Keep a request in flight after its handler returned (while it waits for its I/O);
+        // every Hold is matched by a Release
+        void Hold() {
+            ++this->inFlight;
+        }
+
+        void Release() {
+            --this->inFlight;
+        }
+
+        int InFlight() const {
+            return this->inFlight;
+        }
+
+    private:
+        Config config;
+        std::vector<TokenBucket> clients;
+        std::vector<TokenBucket> lights;
+        std::atomic<int> inFlight{0};
+    };
+}
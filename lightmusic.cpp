@@ -0,0 +1,503 @@
+// Music reactive mode: the song queued for a light is decoded while it plays,
+// analyzed (band energies and beats) and turned into colors and luminosity.
+// The analysis runs on its own pool of workers, never on the HTTP threads.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// WAV (16 bit PCM) is decoded out of the box. MP3 needs the single header
+// minimp3 library (https://github.com/lieff/minimp3): put minimp3.h next to
+// the sources and it is picked up at compile time.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __has_include("minimp3.h")
+#define MINIMP3_IMPLEMENTATION
+#include "minimp3.h"
+#define SMARTLIGHT_HAS_MP3 1
+#endif
+
+namespace LightMusic {
+
+    using Clock = std::chrono::steady_clock;
+
+    static const int    FrameSize   = 1024; // samples analyzed at once (FFT size)
+    static const int    HopSize     = 512;  // samples between two analyzed frames
+    static const int    ReadSize    = 4096; // bytes read from the song file at once
+    static const int    MaxChunk    = 1 << 20; // bytes of a WAV chunk other than the samples
+    static const int    HistorySize = 43;   // ~0.5s of spectral flux used by the beat detector
+    static const double BeatFactor  = 1.5;  // flux above BeatFactor * average is a beat
+
+    // Every light is updated at this period; audio further behind the wall clock
+    // than MaxLag is skipped instead of analyzed, so the lights never lag the song.
+    static const Clock::duration Period = std::chrono::milliseconds(20);
+    static const Clock::duration MaxLag = std::chrono::milliseconds(200);
+
+    // What a light should show at a given moment of the song
+    struct Reaction {
+        int R, G, B, luminosity;
+        bool beat;
+    };
+
+    // Streaming decoders: bytes go in as they are read, mono samples in -1..1 come out
+    class Decoder {
+    public:
+        virtual ~Decoder() {}
+        virtual void Feed(const uint8_t *data, size_t size, std::vector<float> &out) = 0;
+        // 0 until the header was decoded
+        virtual int SampleRate() const = 0;
+    };
+
+    class WavDecoder : public Decoder {
+    public:
+        void Feed(const uint8_t *data, size_t size, std::vector<float> &out) override {
+            pending.insert(pending.end(), data, data + size);
+
+            while (! inData) {
+                if (! ParseChunk())
+                    return;
+            }
+
+            // the chunks after the samples (LIST, id3) are not decoded
+            size_t frameBytes = 2 * channels;
+            size_t usable = std::min<size_t>(pending.size(), remaining) / frameBytes * frameBytes;
+            for (size_t i = 0; i < usable; i += frameBytes) {
+                float sum = 0;
+                for (int c = 0; c < channels; c++)
+                    sum += (int16_t) (pending[i + 2 * c] | (pending[i + 2 * c + 1] << 8)) / 32768.0f;
+                out.push_back(sum / channels);
+            }
+            pending.erase(pending.begin(), pending.begin() + usable);
+            remaining -= usable;
+            if (remaining < frameBytes)
+                pending.clear();
+        }
+
+        int SampleRate() const override {
+            return inData ? rate : 0;
+        }
+
+    private:
+        // Consume one RIFF header or chunk header; false if more bytes are needed
+        bool ParseChunk() {
+            if (! inRiff) {
+                if (pending.size() < 12)
+                    return false;
+                if (memcmp(pending.data(), "RIFF", 4) || memcmp(pending.data() + 8, "WAVE", 4))
+                    throw "The song is not a valid WAV file";
+                pending.erase(pending.begin(), pending.begin() + 12);
+                inRiff = true;
+            }
+            if (pending.size() < 8)
+                return false;
+
+            uint32_t chunkSize = Le32(&pending[4]);
+            if (! memcmp(pending.data(), "data", 4)) {
+                if (rate == 0 || channels == 0)
+                    throw "The WAV file has no format chunk";
+                pending.erase(pending.begin(), pending.begin() + 8);
+                remaining = chunkSize;
+                inData = true;
+                return true;
+            }
+            if (chunkSize > MaxChunk)
+                throw "The WAV file has a chunk that is too big";
+            // the chunks are padded to an even size
+            size_t whole = 8 + (size_t) chunkSize + (chunkSize & 1);
+            if (pending.size() < whole)
+                return false;
+            if (! memcmp(pending.data(), "fmt ", 4)) {
+                if (chunkSize < 16)
+                    throw "The WAV file has a format chunk that is too short";
+                int format = pending[8] | (pending[9] << 8);
+                int bits   = pending[22] | (pending[23] << 8);
+                if (format != 1 || bits != 16)
+                    throw "Only 16 bit PCM WAV files are supported";
+                channels = pending[10] | (pending[11] << 8);
+                rate     = (int) Le32(&pending[12]);
+                if (channels == 0 || rate <= 0)
+                    throw "The WAV file has a format chunk that is not valid";
+            }
+            pending.erase(pending.begin(), pending.begin() + whole);
+            return true;
+        }
+
+        static uint32_t Le32(const uint8_t *p) {
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+        }
+
+        std::vector<uint8_t> pending;
+        bool inRiff = false, inData = false;
+        int rate = 0, channels = 0;
+        size_t remaining = 0; // bytes of the data chunk not decoded yet
+    };
+
+#ifdef SMARTLIGHT_HAS_MP3
+    class Mp3Decoder : public Decoder {
+    public:
+        Mp3Decoder() {
+            mp3dec_init(&decoder);
+        }
+
+        void Feed(const uint8_t *data, size_t size, std::vector<float> &out) override {
+            pending.insert(pending.end(), data, data + size);
+            mp3d_sample_t pcm[MINIMP3_MAX_SAMPLES_PER_FRAME];
+            mp3dec_frame_info_t info;
+
+            // keep enough bytes buffered for minimp3 to find the next frame (unless the file ended)
+            while (size == 0 ? ! pending.empty() : pending.size() >= 16 * 1024) {
+                int samples = mp3dec_decode_frame(&decoder, pending.data(), (int) pending.size(), pcm, &info);
+                if (info.frame_bytes == 0)
+                    break;
+                pending.erase(pending.begin(), pending.begin() + info.frame_bytes);
+                if (samples == 0)
+                    continue;
+                rate = info.hz;
+                for (int i = 0; i < samples; i++) {
+                    float sum = 0;
+                    for (int c = 0; c < info.channels; c++)
+                        sum += pcm[i * info.channels + c] / 32768.0f;
+                    out.push_back(sum / info.channels);
+                }
+            }
+            if (size == 0)
+                pending.clear();
+        }
+
+        int SampleRate() const override {
+            return rate;
+        }
+
+    private:
+        mp3dec_t decoder;
+        std::vector<uint8_t> pending;
+        int rate = 0;
+    };
+#endif
+
+    // Chooses the decoder from the first bytes of the file
+    std::unique_ptr<Decoder> MakeDecoder(const uint8_t *head, size_t size) {
+        if (size >= 4 && ! memcmp(head, "RIFF", 4))
+            return std::unique_ptr<Decoder>(new WavDecoder());
+#ifdef SMARTLIGHT_HAS_MP3
+        return std::unique_ptr<Decoder>(new Mp3Decoder());
+#else
+        throw "MP3 songs need minimp3.h at compile time";
+#endif
+    }
+
+    // Band energies and beat detection over consecutive frames of FrameSize samples
+    class Analyzer {
+    public:
+        Analyzer() : window(FrameSize), twiddle(FrameSize / 2), spectrum(FrameSize),
+                     magnitude(FrameSize / 2 + 1, 0), previous(FrameSize / 2 + 1, 0)
+        {
+            const double pi = std::acos(-1.0);
+            for (int i = 0; i < FrameSize; i++)
+                window[i] = (float) (0.5 - 0.5 * std::cos(2 * pi * i / (FrameSize - 1)));
+            for (int i = 0; i < FrameSize / 2; i++)
+                twiddle[i] = std::polar(1.0f, (float) (-2 * pi * i / FrameSize));
+        }
+
+        Reaction Analyze(const float *samples, int sampleRate) {
+            for (int i = 0; i < FrameSize; i++)
+                spectrum[i] = samples[i] * window[i];
+            FFT();
+
+            // bass drives red, mids drive green and highs drive blue
+            static const float edges[4] = {20, 250, 2000, 8000};
+            float band[3] = {0, 0, 0}, flux = 0, total = 0;
+            for (int k = 1; k <= FrameSize / 2; k++) {
+                float hz = (float) k * sampleRate / FrameSize;
+                magnitude[k] = std::abs(spectrum[k]);
+                flux += std::max(0.0f, magnitude[k] - previous[k]);
+                previous[k] = magnitude[k];
+                for (int b = 0; b < 3; b++) {
+                    if (edges[b] <= hz && hz < edges[b + 1])
+                        band[b] += magnitude[k] * magnitude[k];
+                }
+            }
+
+            Reaction reaction;
+            int *channel[3] = {&reaction.R, &reaction.G, &reaction.B};
+            for (int b = 0; b < 3; b++) {
+                // slowly decaying peaks keep the colors relative to the song itself
+                peak[b] = std::max(band[b], peak[b] * 0.995f);
+                *channel[b] = peak[b] > 0 ? (int) (255 * std::sqrt(band[b] / peak[b])) : 0;
+                total += band[b];
+            }
+            totalPeak = std::max(total, totalPeak * 0.995f);
+
+            float average = 0;
+            for (float f: fluxHistory)
+                average += f;
+            average = fluxHistory.empty() ? 0 : average / fluxHistory.size();
+            reaction.beat = fluxHistory.size() == HistorySize && flux > BeatFactor * average && flux > 0;
+            fluxHistory.push_back(flux);
+            if ((int) fluxHistory.size() > HistorySize)
+                fluxHistory.pop_front();
+
+            // the luminosity follows the loudness and flashes on every beat
+            float level = totalPeak > 0 ? std::sqrt(total / totalPeak) : 0;
+            flash = reaction.beat ? 1.0f : flash * 0.85f;
+            reaction.luminosity = std::min(100, (int) (20 + 50 * level + 30 * flash));
+            return reaction;
+        }
+
+    private:
+        // In place iterative radix-2 FFT of spectrum
+        void FFT() {
+            for (int i = 1, j = 0; i < FrameSize; i++) {
+                int bit = FrameSize >> 1;
+                for (; j & bit; bit >>= 1)
+                    j ^= bit;
+                j ^= bit;
+                if (i < j)
+                    std::swap(spectrum[i], spectrum[j]);
+            }
+            for (int len = 2; len <= FrameSize; len <<= 1) {
+                int step = FrameSize / len;
+                for (int i = 0; i < FrameSize; i += len) {
+                    for (int k = 0; k < len / 2; k++) {
+                        std::complex<float> u = spectrum[i + k];
+                        std::complex<float> v = spectrum[i + k + len / 2] * twiddle[k * step];
+                        spectrum[i + k] = u + v;
+                        spectrum[i + k + len / 2] = u - v;
+                    }
+                }
+            }
+        }
+
+        std::vector<float> window;
+        std::vector<std::complex<float>> twiddle, spectrum;
+        std::vector<float> magnitude, previous;
+        std::deque<float> fluxHistory;
+        float peak[3] = {0, 0, 0}, totalPeak = 0, flash = 0;
+    };
+
+    // One light playing one song; every Step analyzes the audio up to the wall clock
+    class Session {
+    public:
+        using Callback = std::function<void(const Reaction&)>;
+
+        // Decodes the header of the song right away; throws a message if it cannot be decoded
+        Session(int id, const std::string &path, Callback callback)
+            : id(id), file(path, std::ifstream::binary), callback(callback)
+        {
+            if (! file.is_open())
+                throw "The song could not be opened";
+            while (! this->ended && this->rate == 0)
+                this->Read();
+            if (this->rate == 0)
+                throw "The song could not be decoded";
+        }
+
+        int Id() const {
+            return this->id;
+        }
+
+        void Cancel() {
+            this->cancelled = true;
+        }
+
+        bool IsCancelled() const {
+            return this->cancelled;
+        }
+
+        // Analyze everything that should have played by now; false once the song is over
+        bool Step() {
+            if (this->cancelled)
+                return false;
+
+            Clock::time_point now = Clock::now();
+            if (this->started == Clock::time_point())
+                this->started = now;
+
+            while (! this->ended && (this->rate == 0 ||
+                   this->position + (long long) this->samples.size() < this->SamplesUntil(now) + FrameSize))
+                this->Read();
+            if (this->rate == 0)
+                return false;
+
+            // bounded latency: audio too far behind the clock is dropped, not analyzed
+            long long target = this->SamplesUntil(now);
+            long long lagLimit = this->SamplesUntil(now - MaxLag);
+            if (this->position < lagLimit)
+                this->Skip(lagLimit - this->position);
+
+            bool analyzed = false;
+            Reaction last = {0, 0, 0, 0, false};
+            bool beat = false;
+            while (this->position + HopSize <= target && (long long) this->samples.size() >= FrameSize) {
+                last = this->analyzer.Analyze(this->samples.data(), this->rate);
+                beat |= last.beat;
+                analyzed = true;
+                this->Skip(HopSize);
+            }
+            if (analyzed) {
+                last.beat = beat;
+                this->callback(last);
+            }
+
+            return ! (this->ended && (long long) this->samples.size() < FrameSize);
+        }
+
+    private:
+        long long SamplesUntil(Clock::time_point when) const {
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(when - this->started).count();
+            return std::max(0LL, (long long) elapsed * this->rate / 1000000);
+        }
+
+        void Read() {
+            uint8_t buffer[ReadSize];
+            this->file.read((char *) buffer, ReadSize);
+            size_t got = this->file.gcount();
+            if (! this->decoder)
+                this->decoder = MakeDecoder(buffer, got);
+            this->decoder->Feed(buffer, got, this->samples);
+            if (got == 0 || ! this->file) {
+                if (got != 0)
+                    this->decoder->Feed(buffer, 0, this->samples); // flush
+                this->ended = true;
+            }
+            this->rate = this->decoder->SampleRate();
+        }
+
+        void Skip(long long count) {
+            count = std::min(count, (long long) this->samples.size());
+            this->samples.erase(this->samples.begin(), this->samples.begin() + count);
+            this->position += count;
+        }
+
+        int id;
+        std::ifstream file;
+        Callback callback;
+        std::unique_ptr<Decoder> decoder;
+        Analyzer analyzer;
+        std::vector<float> samples;  // decoded but not yet analyzed
+        long long position = 0;      // index in the song of samples[0]
+        int rate = 0;
+        bool ended = false;
+        std::atomic<bool> cancelled{false};
+        Clock::time_point started;
+    };
+
+    // Fixed pool of workers stepping the sessions in the order of their deadlines
+    class WorkerPool {
+    public:
+        explicit WorkerPool(int nrWorkers) {
+            for (int i = 0; i < std::max(1, nrWorkers); i++)
+                workers.emplace_back(&WorkerPool::Work, this);
+        }
+
+        ~WorkerPool() {
+            Stop();
+        }
+
+        // Start reacting to a song on a light, replacing what it was reacting to before
+        void Start(std::shared_ptr<Session> session) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto found = sessions.find(session->Id());
+            if (found != sessions.end())
+                found->second->Cancel();
+            sessions[session->Id()] = session;
+            queue.push({Clock::now(), session});
+            wakeup.notify_one();
+        }
+
+        void Cancel(int id) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto found = sessions.find(id);
+            if (found != sessions.end()) {
+                found->second->Cancel();
+                sessions.erase(found);
+            }
+        }
+
+        bool IsRunning(int id) {
+            std::lock_guard<std::mutex> guard(lock);
+            return sessions.count(id) != 0;
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (stopping)
+                    return;
+                stopping = true;
+                for (auto &s: sessions)
+                    s.second->Cancel();
+                wakeup.notify_all();
+            }
+            for (std::thread &t: workers)
+                t.join();
+        }
+
+    private:
+        struct Task {
+            Clock::time_point due;
+            std::shared_ptr<Session> session;
+            bool operator> (const Task &other) const {
+                return due > other.due;
+            }
+        };
+
+        void Work() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (! stopping) {
+                if (queue.empty()) {
+                    wakeup.wait(guard);
+                    continue;
+                }
+                if (queue.top().due > Clock::now()) {
+                    wakeup.wait_until(guard, queue.top().due);
+                    continue;
+                }
+                Task task = queue.top();
+                queue.pop();
+
+                guard.unlock();
+                bool more = false;
+                try {
+                    more = task.session->Step();
+                } catch (char const* str) {
+                    Generic::printError((std::string) "Reactive mode of light " + std::to_string(task.session->Id()) + ": " + str);
+                } catch (...) {
+                    Generic::printError("Reactive mode of light " + std::to_string(task.session->Id()) + " failed");
+                }
+                guard.lock();
+
+                if (more && ! task.session->IsCancelled()) {
+                    // a late session is stepped again one period from now, it skips what it missed
+                    queue.push({std::max(task.due + Period, Clock::now()), task.session});
+                } else {
+                    auto found = sessions.find(task.session->Id());
+                    if (found != sessions.end() && found->second == task.session)
+                        sessions.erase(found);
+                }
+            }
+        }
+
+        std::mutex lock;
+        std::condition_variable wakeup;
+        std::priority_queue<Task, std::vector<Task>, std::greater<Task>> queue;
+        std::map<int, std::shared_ptr<Session>> sessions;
+        std::vector<std::thread> workers;
+        bool stopping = false;
+    };
+}
@@ -0,0 +1,104 @@
+// Sequence locks over the records of SettingConfigs.data, so read-only replica
+// servers can map the file of the writing server and read consistent records
+// without taking its locks (which live in the memory of the writing process).
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// Every record starts with a 32 bit sequence: odd while the record is being
+// written, incremented again once it is consistent. A reader copies the record
+// and keeps the copy if the sequence was even and did not change meanwhile.
+// The writing server repairs the records a crashed writer left odd when it starts.
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace LightReplica {
+
+    // The records the current thread has a section of, and whether they were opened
+    struct Held {
+        std::atomic<uint32_t> *seq;
+        bool open;
+    };
+
+    inline std::vector<Held>& HeldRecords() {
+        thread_local std::vector<Held> held;
+        return held;
+    }
+
+    // Marks a record as being written while alive (the writers of a record must be
+    // serialized by a lock of their own). Nested sections of the same record are
+    // allowed, only the outermost one opens and closes the record. A deferred section
+    // (of a reader that may write) leaves the record untouched until a section nested
+    // in it opens it, then keeps it open until its own end.
+    class WriteSection {
+    public:
+        explicit WriteSection(std::atomic<uint32_t> &seq, bool deferred = false) : seq(seq) {
+            std::vector<Held> &held = HeldRecords();
+            for (Held &h: held) {
+                if (h.seq != &seq)
+                    continue;
+                if (! h.open) {
+                    Open(seq);
+                    h.open = true;
+                }
+                return;
+            }
+            outermost = true;
+            held.push_back({&seq, ! deferred});
+            if (! deferred)
+                Open(seq);
+        }
+
+        ~WriteSection() {
+            if (! outermost)
+                return;
+            std::vector<Held> &held = HeldRecords();
+            for (size_t i = held.size(); i-- > 0; ) {
+                if (held[i].seq != &seq)
+                    continue;
+                if (held[i].open)
+                    seq.store((seq.load(std::memory_order_relaxed) | 1) + 1, std::memory_order_release);
+                held.erase(held.begin() + i);
+                break;
+            }
+        }
+
+        WriteSection(const WriteSection&) = delete;
+        WriteSection& operator= (const WriteSection&) = delete;
+
+    private:
+        static void Open(std::atomic<uint32_t> &seq) {
+            seq.store(seq.load(std::memory_order_relaxed) | 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        std::atomic<uint32_t> &seq;
+        bool outermost = false;
+    };
+
+    // A record left odd by a writer that died while writing it (before the first write of the next one)
+    inline void Repair(std::atomic<uint32_t> &seq) {
+        uint32_t current = seq.load(std::memory_order_relaxed);
+        if (current & 1)
+            seq.store(current + 1, std::memory_order_release);
+    }
+
+    // Make a copy of a record guarded by seq with copy(); false if no consistent copy
+    // could be made in `attempts` tries (the record is written continuously)
+    template <typename Copy>
+    bool Read(const std::atomic<uint32_t> &seq, Copy copy, int attempts = 1000) {
+        for (int attempt = 0; attempt < attempts; attempt++) {
+            uint32_t before = seq.load(std::memory_order_acquire);
+            if (! (before & 1)) {
+                copy();
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq.load(std::memory_order_relaxed) == before)
+                    return true;
+            }
+            if (attempt % 64 == 63)
+                std::this_thread::yield();
+        }
+        return false;
+    }
+}
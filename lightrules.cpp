@@ -0,0 +1,334 @@
+// Automation rules: "when these inputs of a light are in these ranges, apply this scene".
+// The rules are compiled into a decision table (one row of interval conditions per rule)
+// indexed by light and input, so an event only evaluates the rules over the input it changed.
+// A rule fires when its conditions become true, and again only after they were false.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// Rule format (a JSON array of rules):
+//   {"name": "dusk", "lights": [0, 1],                  (all the lights if left out)
+//    "when": [{"input": "s_luminosity", "op": "<", "value": 30},
+//             {"input": "time", "op": "between", "from": "18:00", "to": "23:30"}],
+//    "then": {"powered": 1, "manual": 1, "R": 255, "G": 160, "B": 60, "luminosity": 70}}
+// Inputs: s_luminosity, s_temperature, time (minute of the day, values as "HH:MM"),
+// alarm (1 during the minute of an alarm of the light), impact (value of an MQTT alert).
+// Operators: < <= > >= == != between outside (a between window may wrap over midnight).
+// A condition over an input the light has not received yet (no sensor value so far) is false.
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace LightRules {
+
+    enum Input : uint8_t {
+        SensorLuminosity,
+        SensorTemperature,
+        Time,
+        Alarm,
+        Impact,
+        NrInputs
+    };
+
+    static const char* InputNames[NrInputs] = {"s_luminosity", "s_temperature", "time", "alarm", "impact"};
+
+    // A row of the decision table holds one condition per input it tests
+    struct Condition {
+        Input input;
+        bool inside;    // true if the value must be in [lo, hi], false if out of it
+        int32_t lo, hi;
+    };
+
+    // The scene a rule applies: only the fields in mask are changed
+    struct Action {
+        enum Field : uint8_t {Powered = 1, Manual = 2, Color = 4, Luminosity = 8, Temperature = 16};
+        uint8_t mask = 0;
+        bool powered = false, manual = false;
+        int R = 0, G = 0, B = 0, luminosity = 0, temperature = 0;
+    };
+
+    class Table {
+    public:
+        // Compile the rules; throws a message (std::string) naming the rule that is not valid
+        Table(const json &rules, int nrLights) : source(rules), nrLights(nrLights), index(nrLights * NrInputs) {
+            if (! rules.is_array())
+                throw std::string("The rules must be an array");
+            for (size_t r = 0; r < rules.size(); r++) {
+                const json &rule = rules[r];
+                std::string name = rule.is_object() ? rule.value("name", "#" + std::to_string(r)) : "#" + std::to_string(r);
+                try {
+                    Compile(rule, (int) r);
+                } catch (char const* str) {
+                    throw "The rule " + name + " is not valid: " + str;
+                } catch (const std::exception &e) {
+                    throw "The rule " + name + " is not valid: " + e.what();
+                } catch (...) {
+                    throw "The rule " + name + " is not valid";
+                }
+            }
+        }
+
+        int NrRules() const {
+            return (int) actions.size();
+        }
+
+        // The rules of a light testing an input
+        const std::vector<int>& RulesOf(int light, Input input) const {
+            return index[light * NrInputs + input];
+        }
+
+        // known has the bit of every input that received a value, the conditions over the others are false
+        bool Holds(int rule, const int32_t *values, uint32_t known) const {
+            for (int c = firsts[rule]; c < firsts[rule + 1]; c++) {
+                const Condition &condition = conditions[c];
+                if (! (known & (1u << condition.input)))
+                    return false;
+                int32_t v = values[condition.input];
+                if ((condition.lo <= v && v <= condition.hi) != condition.inside)
+                    return false;
+            }
+            return true;
+        }
+
+        const Action& ActionOf(int rule) const {
+            return actions[rule];
+        }
+
+        const json source;
+
+    private:
+        static Input InputOf(const std::string &name) {
+            for (int i = 0; i < NrInputs; i++) {
+                if (name == InputNames[i])
+                    return (Input) i;
+            }
+            throw "Unknown input";
+        }
+
+        // A number, or "HH:MM" for the time
+        static int32_t ValueOf(const json &value) {
+            if (value.is_number_integer())
+                return value.get<int32_t>();
+            if (value.is_boolean())
+                return value.get<bool>();
+            if (value.is_string()) {
+                std::string text = value.get<std::string>();
+                int hours, minutes;
+                char rest;
+                if (sscanf(text.c_str(), "%d:%d%c", &hours, &minutes, &rest) == 2 &&
+                        0 <= hours && hours < 24 && 0 <= minutes && minutes < 60)
+                    return hours * 60 + minutes;
+            }
+            throw "A value is not a number or a time";
+        }
+
+        static Condition ConditionOf(const json &when) {
+            Condition condition;
+            condition.input = InputOf(when.at("input").get<std::string>());
+            std::string op = when.at("op").get<std::string>();
+            condition.inside = true;
+            condition.lo = INT_MIN;
+            condition.hi = INT_MAX;
+            if (op == "between" || op == "outside") {
+                int32_t from = ValueOf(when.at("from")), to = ValueOf(when.at("to"));
+                condition.inside = op == "between";
+                if (from > to) {
+                    // a window over midnight is the outside of the window between its ends
+                    if (condition.input != Time)
+                        throw "The range of a condition is empty";
+                    condition.inside = ! condition.inside;
+                    std::swap(from, to);
+                    from++;
+                    to--;
+                }
+                condition.lo = from;
+                condition.hi = to;
+                return condition;
+            }
+
+            int32_t value = ValueOf(when.at("value"));
+            if (op == "<" && value != INT_MIN)
+                condition.hi = value - 1;
+            else if (op == "<=")
+                condition.hi = value;
+            else if (op == ">" && value != INT_MAX)
+                condition.lo = value + 1;
+            else if (op == ">=")
+                condition.lo = value;
+            else if (op == "==" || op == "!=") {
+                condition.lo = condition.hi = value;
+                condition.inside = op == "==";
+            } else
+                throw "Unknown operator";
+            return condition;
+        }
+
+        static Action SceneOf(const json &then) {
+            Action action;
+            if (! then.is_object() || then.empty())
+                throw "The rule has no scene";
+            for (auto &field: then.items()) {
+                const std::string &key = field.key();
+                int value = field.value().is_boolean() ? (int) field.value().get<bool>() : field.value().get<int>();
+                if (key == "powered")
+                    action.mask |= Action::Powered, action.powered = value;
+                else if (key == "manual")
+                    action.mask |= Action::Manual, action.manual = value;
+                else if (key == "R" || key == "G" || key == "B") {
+                    if (value < 0 || value > 255)
+                        throw "A color of the scene is not between 0 and 255";
+                    action.mask |= Action::Color;
+                    (key == "R" ? action.R : key == "G" ? action.G : action.B) = value;
+                }
+                else if (key == "luminosity" || key == "temperature") {
+                    if (value < 0 || value > 100)
+                        throw "The luminosity and the temperature of the scene must be between 0 and 100";
+                    action.mask |= key == "luminosity" ? Action::Luminosity : Action::Temperature;
+                    (key == "luminosity" ? action.luminosity : action.temperature) = value;
+                }
+                else
+                    throw "Unknown field of the scene";
+            }
+            // a scene setting only some of R, G and B keeps the others of the light
+            if ((action.mask & Action::Color) && ! (then.contains("R") && then.contains("G") && then.contains("B")))
+                throw "The scene must set R, G and B together";
+            return action;
+        }
+
+        void Compile(const json &rule, int r) {
+            std::vector<bool> lights(nrLights, ! rule.contains("lights"));
+            if (rule.contains("lights")) {
+                for (const json &light: rule.at("lights")) {
+                    int id = light.get<int>();
+                    if (id < 0 || id >= nrLights)
+                        throw "The rule is about a light that is unavailable";
+                    lights[id] = true;
+                }
+            }
+
+            const json &when = rule.at("when");
+            if (! when.is_array() || when.empty())
+                throw "The rule has no condition";
+            firsts.resize(r + 1, (int) conditions.size());
+            std::vector<bool> tested(NrInputs);
+            for (const json &w: when) {
+                conditions.push_back(ConditionOf(w));
+                tested[conditions.back().input] = true;
+            }
+            firsts.push_back((int) conditions.size());
+            actions.push_back(SceneOf(rule.at("then")));
+
+            for (int light = 0; light < nrLights; light++) {
+                for (int input = 0; input < NrInputs; input++) {
+                    if (lights[light] && tested[input])
+                        index[light * NrInputs + input].push_back(r);
+                }
+            }
+        }
+
+        int nrLights;
+        std::vector<Condition> conditions;      // the conditions of all the rules, rule after rule
+        std::vector<int> firsts;                // first condition of every rule (and one past the last)
+        std::vector<Action> actions;
+        std::vector<std::vector<int>> index;    // rules by light and input
+    };
+
+    class Engine {
+    public:
+        explicit Engine(int nrLights) : nrLights(nrLights), lights(nrLights) {
+            std::atomic_store(&table, std::make_shared<const Table>(json::array(), nrLights));
+        }
+
+        // Replace the rules; throws a message (std::string) if they are not valid
+        void Load(const json &rules) {
+            std::atomic_store(&table, std::make_shared<const Table>(rules, nrLights));
+        }
+
+        json Source() const {
+            return std::atomic_load(&table)->source;
+        }
+
+        /** Set an input of a light and collect the scenes of the rules that became true
+         *  (called while holding the lock of the light)
+         *  Impacts are events, the rules over them are armed again right after.
+         **/
+        void Event(int light, Input input, int32_t value, std::vector<Action> &fired) {
+            if (light < 0 || light >= nrLights)
+                return;
+            State &state = lights[light];
+            auto current = std::atomic_load(&table);
+            if (state.table != current) {
+                // new rules start disarmed until their conditions are checked
+                state.table = current;
+                state.active.assign(current->NrRules(), false);
+            }
+
+            state.values[input] = value;
+            state.known |= 1u << input;
+            for (int rule: current->RulesOf(light, input)) {
+                bool holds = current->Holds(rule, state.values, state.known);
+                if (holds && ! state.active[rule])
+                    fired.push_back(current->ActionOf(rule));
+                state.active[rule] = holds && input != Impact;
+            }
+            if (input == Impact)
+                state.values[Impact] = 0;
+        }
+
+        /** The inputs of a light and the rules that hold for it, to move the light to another server
+         *  (called while holding the lock of the light)
+         **/
+        json ExportState(int light) {
+            json j;
+            if (light < 0 || light >= nrLights)
+                return j;
+            State &state = lights[light];
+            j["values"] = std::vector<int32_t>(state.values, state.values + NrInputs);
+            j["known"] = state.known;
+            auto current = std::atomic_load(&table);
+            if (state.table == current) {
+                j["rules"] = Fingerprint(*current);
+                j["active"] = state.active;
+            }
+            return j;
+        }
+
+        /** Take the state of a light moved from another server; the rules that held there still hold
+         *  (and do not fire again) if the servers have the same rules, otherwise they start disarmed.
+         *  (called while holding the lock of the light)
+         **/
+        void ImportState(int light, const json &j) {
+            if (light < 0 || light >= nrLights)
+                return;
+            State &state = lights[light];
+            auto current = std::atomic_load(&table);
+            state.table = current;
+            state.active.assign(current->NrRules(), false);
+            std::vector<int32_t> values = j.at("values").get<std::vector<int32_t>>();
+            for (int i = 0; i < NrInputs && i < (int) values.size(); i++)
+                state.values[i] = values[i];
+            state.known = j.at("known").get<uint32_t>() & ((1u << NrInputs) - 1);
+            if (j.contains("rules") && j["rules"].get<std::string>() == Fingerprint(*current) &&
+                    j["active"].size() == state.active.size())
+                state.active = j["active"].get<std::vector<bool>>();
+        }
+
+    private:
+        static std::string Fingerprint(const Table &rules) {
+            return std::to_string(std::hash<std::string>()(rules.source.dump()));
+        }
+
+        struct State {
+            int32_t values[NrInputs] = {0, 0, 0, 0, 0};
+            uint32_t known = 0;
+            std::shared_ptr<const Table> table;
+            std::vector<bool> active;
+        };
+
+        int nrLights;
+        std::vector<State> lights;
+        std::shared_ptr<const Table> table;
+    };
+}
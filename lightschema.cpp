@@ -0,0 +1,578 @@
+// Validation of the buffer tokens of POST /settings against the schema of
+// smartlight_settings.json (token_type, byte_size, regex-rule). A token given in a
+// request must have a value (optional only means a token can be left out, as all can).
+// Every regex-rule is compiled once, at startup, into a DFA over bytes, or into
+// a range check when the rule accepts exactly the decimal numbers of a range,
+// so a value is validated in one pass over its bytes without std::regex.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+//
+// Supported rules: literals, ., [...] classes with ranges and negation, \d \w \s,
+// groups, |, *, +, ? and {m}, {m,}, {m,n}. A rule must match the whole value.
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+namespace LightSchema {
+
+    using ByteSet = std::bitset<256>;
+
+    static const int MaxRepeat    = 1000; // largest bound of a {m,n}
+    static const int MaxDfaStates = 4096;
+    static const int MaxRangeLen  = 4;    // longest numbers checked for a range rule (10^4 values)
+
+    // Syntax tree of a rule
+    struct Node {
+        enum Type {Set, Concat, Alt, Repeat} type;
+        ByteSet set;
+        std::vector<std::unique_ptr<Node>> children;
+        int min = 0, max = 0; // Repeat; max -1 is unbounded
+    };
+
+    class Parser {
+    public:
+        explicit Parser(const std::string &rule) : rule(rule) {}
+
+        std::unique_ptr<Node> Parse() {
+            auto node = ParseAlt();
+            if (pos != rule.size())
+                throw "Unbalanced ) in the rule";
+            return node;
+        }
+
+    private:
+        std::unique_ptr<Node> Make(Node::Type type) {
+            std::unique_ptr<Node> node(new Node());
+            node->type = type;
+            return node;
+        }
+
+        bool More() const {
+            return pos < rule.size();
+        }
+
+        std::unique_ptr<Node> ParseAlt() {
+            auto first = ParseConcat();
+            if (! More() || rule[pos] != '|')
+                return first;
+            auto alt = Make(Node::Alt);
+            alt->children.push_back(std::move(first));
+            while (More() && rule[pos] == '|') {
+                pos++;
+                alt->children.push_back(ParseConcat());
+            }
+            return alt;
+        }
+
+        std::unique_ptr<Node> ParseConcat() {
+            auto concat = Make(Node::Concat);
+            while (More() && rule[pos] != '|' && rule[pos] != ')')
+                concat->children.push_back(ParseRepeat());
+            return concat;
+        }
+
+        std::unique_ptr<Node> ParseRepeat() {
+            auto node = ParseAtom();
+            while (More()) {
+                int min, max;
+                char c = rule[pos];
+                if (c == '*')
+                    min = 0, max = -1;
+                else if (c == '+')
+                    min = 1, max = -1;
+                else if (c == '?')
+                    min = 0, max = 1;
+                else if (c == '{')
+                    ParseBounds(min, max);
+                else
+                    break;
+                if (c != '{')
+                    pos++;
+                auto repeat = Make(Node::Repeat);
+                repeat->min = min;
+                repeat->max = max;
+                repeat->children.push_back(std::move(node));
+                node = std::move(repeat);
+            }
+            return node;
+        }
+
+        void ParseBounds(int &min, int &max) {
+            size_t close = rule.find('}', pos);
+            if (close == std::string::npos)
+                throw "Unbalanced { in the rule";
+            std::string bounds = rule.substr(pos + 1, close - pos - 1);
+            size_t comma = bounds.find(',');
+            try {
+                min = std::stoi(bounds.substr(0, comma));
+                if (comma == std::string::npos)
+                    max = min;
+                else if (comma + 1 == bounds.size())
+                    max = -1;
+                else
+                    max = std::stoi(bounds.substr(comma + 1));
+            } catch (...) {
+                throw "Wrong bounds of a repetition in the rule";
+            }
+            if (min < 0 || min > MaxRepeat || max > MaxRepeat || (max != -1 && max < min))
+                throw "Wrong bounds of a repetition in the rule";
+            pos = close + 1;
+        }
+
+        std::unique_ptr<Node> ParseAtom() {
+            char c = rule[pos++];
+            if (c == '(') {
+                auto node = ParseAlt();
+                if (! More() || rule[pos] != ')')
+                    throw "Unbalanced ( in the rule";
+                pos++;
+                return node;
+            }
+            auto node = Make(Node::Set);
+            if (c == '[')
+                node->set = ParseClass();
+            else if (c == '.')
+                node->set.set().reset('\n');
+            else if (c == '\\')
+                node->set = ParseEscape();
+            else if (c == '*' || c == '+' || c == '?' || c == '{')
+                throw "Nothing to repeat in the rule";
+            else
+                node->set.set((unsigned char) c);
+            return node;
+        }
+
+        ByteSet ParseEscape() {
+            if (! More())
+                throw "Dangling \\ in the rule";
+            ByteSet set;
+            char c = rule[pos++];
+            switch (c) {
+            case 'd': case 'D':
+                for (int b = '0'; b <= '9'; b++)
+                    set.set(b);
+                break;
+            case 'w': case 'W':
+                for (int b = 0; b < 256; b++)
+                    set[b] = isalnum(b) || b == '_';
+                break;
+            case 's': case 'S':
+                for (char b: std::string(" \t\n\r\f\v"))
+                    set.set((unsigned char) b);
+                break;
+            case 'n':
+                set.set('\n');
+                break;
+            case 't':
+                set.set('\t');
+                break;
+            default:
+                set.set((unsigned char) c);
+                return set;
+            }
+            if (isupper(c))
+                set.flip();
+            return set;
+        }
+
+        ByteSet ParseClass() {
+            ByteSet set;
+            bool negated = More() && rule[pos] == '^';
+            if (negated)
+                pos++;
+            bool first = true;
+            while (More() && (rule[pos] != ']' || first)) {
+                first = false;
+                ByteSet item;
+                unsigned char low = rule[pos];
+                if (low == '\\') {
+                    pos++;
+                    item = ParseEscape();
+                    if (item.count() != 1) {
+                        set |= item;
+                        continue;
+                    }
+                    for (low = 0; ! item[low]; low++)
+                        ;
+                } else {
+                    pos++;
+                }
+                unsigned char high = low;
+                if (pos + 1 < rule.size() && rule[pos] == '-' && rule[pos + 1] != ']') {
+                    high = rule[pos + 1];
+                    pos += 2;
+                    if (high < low)
+                        throw "Wrong range of a class in the rule";
+                }
+                for (int b = low; b <= high; b++)
+                    set.set(b);
+            }
+            if (! More())
+                throw "Unbalanced [ in the rule";
+            pos++;
+            return negated ? ~set : set;
+        }
+
+        const std::string &rule;
+        size_t pos = 0;
+    };
+
+    // Thompson construction of the NFA of a syntax tree
+    class Nfa {
+    public:
+        struct State {
+            std::vector<int> epsilon;
+            ByteSet set;
+            int next = -1; // on a byte of set
+        };
+
+        explicit Nfa(const Node &root) {
+            std::pair<int, int> fragment = Build(root);
+            start = fragment.first;
+            accept = fragment.second;
+        }
+
+        std::vector<State> states;
+        int start, accept;
+
+    private:
+        int Add() {
+            states.emplace_back();
+            return (int) states.size() - 1;
+        }
+
+        std::pair<int, int> Build(const Node &node) {
+            int in = Add(), out = in;
+            switch (node.type) {
+            case Node::Set:
+                out = Add();
+                states[in].set = node.set;
+                states[in].next = out;
+                break;
+            case Node::Concat:
+                out = in;
+                for (auto &child: node.children) {
+                    auto fragment = Build(*child);
+                    states[out].epsilon.push_back(fragment.first);
+                    out = fragment.second;
+                }
+                break;
+            case Node::Alt:
+                out = Add();
+                for (auto &child: node.children) {
+                    auto fragment = Build(*child);
+                    states[in].epsilon.push_back(fragment.first);
+                    states[fragment.second].epsilon.push_back(out);
+                }
+                break;
+            case Node::Repeat:
+                out = in;
+                for (int i = 0; i < node.min; i++) {
+                    auto fragment = Build(*node.children[0]);
+                    states[out].epsilon.push_back(fragment.first);
+                    out = fragment.second;
+                }
+                if (node.max == -1) {
+                    // a loop back to a copy of the child that can be skipped
+                    auto fragment = Build(*node.children[0]);
+                    int end = Add();
+                    states[out].epsilon.push_back(fragment.first);
+                    states[out].epsilon.push_back(end);
+                    states[fragment.second].epsilon.push_back(out);
+                    out = end;
+                } else {
+                    // every optional copy can jump to the end
+                    int end = Add();
+                    for (int i = node.min; i < node.max; i++) {
+                        auto fragment = Build(*node.children[0]);
+                        states[out].epsilon.push_back(fragment.first);
+                        states[out].epsilon.push_back(end);
+                        out = fragment.second;
+                    }
+                    states[out].epsilon.push_back(end);
+                    out = end;
+                }
+                break;
+            }
+            return {in, out};
+        }
+    };
+
+    // DFA of a rule: one row of 256 transitions per state, -1 is the dead state
+    class Dfa {
+    public:
+        Dfa() = default;
+
+        explicit Dfa(const std::string &rule) {
+            std::unique_ptr<Node> root = Parser(rule).Parse();
+            Nfa nfa(*root);
+
+            std::map<std::vector<int>, int> ids;
+            std::vector<std::vector<int>> sets;
+            auto stateOf = [&](std::vector<int> set) {
+                Closure(nfa, set);
+                auto found = ids.find(set);
+                if (found != ids.end())
+                    return found->second;
+                if ((int) sets.size() >= MaxDfaStates)
+                    throw "The rule is too complex";
+                int id = (int) sets.size();
+                ids[set] = id;
+                sets.push_back(set);
+                table.resize(table.size() + 256, -1);
+                accepting.push_back(std::binary_search(set.begin(), set.end(), nfa.accept));
+                return id;
+            };
+
+            stateOf({nfa.start});
+            for (size_t id = 0; id < sets.size(); id++) {
+                for (int b = 0; b < 256; b++) {
+                    std::vector<int> next;
+                    for (int s: sets[id]) {
+                        if (nfa.states[s].next != -1 && nfa.states[s].set[b])
+                            next.push_back(nfa.states[s].next);
+                    }
+                    if (! next.empty()) {
+                        int target = stateOf(next);
+                        table[id * 256 + b] = target;
+                    }
+                }
+            }
+        }
+
+        bool Match(const std::string &value) const {
+            int state = 0;
+            for (unsigned char c: value) {
+                state = table[state * 256 + c];
+                if (state < 0)
+                    return false;
+            }
+            return accepting[state];
+        }
+
+        int NrStates() const {
+            return (int) accepting.size();
+        }
+
+        int Next(int state, unsigned char c) const {
+            return table[state * 256 + c];
+        }
+
+        bool Accepting(int state) const {
+            return accepting[state];
+        }
+
+    private:
+        static void Closure(const Nfa &nfa, std::vector<int> &set) {
+            std::vector<int> stack = set;
+            std::vector<bool> seen(nfa.states.size());
+            for (int s: set)
+                seen[s] = true;
+            while (! stack.empty()) {
+                int s = stack.back();
+                stack.pop_back();
+                for (int e: nfa.states[s].epsilon) {
+                    if (! seen[e]) {
+                        seen[e] = true;
+                        set.push_back(e);
+                        stack.push_back(e);
+                    }
+                }
+            }
+            std::sort(set.begin(), set.end());
+        }
+
+        std::vector<int16_t> table;
+        std::vector<bool> accepting;
+    };
+
+    // If the DFA accepts exactly the decimal numbers lo..hi (written without leading zeros),
+    // they are checked as a range instead. false if the rule is not such a range.
+    inline bool AsRange(const Dfa &dfa, long &lo, long &hi, size_t &maxLen) {
+        // the longest accepted number, if the DFA only accepts short strings of digits
+        std::vector<int> depth(dfa.NrStates(), -1);
+        std::vector<int> frontier = {0};
+        depth[0] = 0;
+        maxLen = 0;
+        for (size_t len = 0; ! frontier.empty(); len++) {
+            if (len > (size_t) MaxRangeLen)
+                return false;
+            std::vector<int> next;
+            for (int s: frontier) {
+                if (dfa.Accepting(s))
+                    maxLen = len;
+                for (int b = 0; b < 256; b++) {
+                    int t = dfa.Next(s, b);
+                    if (t < 0)
+                        continue;
+                    if (b < '0' || b > '9')
+                        return false;
+                    next.push_back(t);
+                }
+            }
+            std::sort(next.begin(), next.end());
+            next.erase(std::unique(next.begin(), next.end()), next.end());
+            frontier = next;
+        }
+        if (maxLen == 0)
+            return false;
+
+        // every digit string up to maxLen: accepted exactly when it is a number of the range
+        lo = -1;
+        hi = -1;
+        long limit = 1;
+        for (size_t i = 0; i < maxLen; i++)
+            limit *= 10;
+        for (long v = 0; v < limit; v++) {
+            if (dfa.Match(std::to_string(v))) {
+                if (lo == -1)
+                    lo = v;
+                if (hi != -1 && hi != v - 1)
+                    return false;
+                hi = v;
+            }
+        }
+        if (lo == -1)
+            return false;
+        for (long len = 1, count = 10; len <= (long) maxLen; len++, count *= 10) {
+            for (long v = 0; v < count; v++) {
+                std::string digits = std::to_string(v);
+                digits.insert(0, len - digits.size(), '0');
+                bool canonical = len == 1 || digits[0] != '0';
+                if (dfa.Match(digits) != (canonical && lo <= v && v <= hi))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // The validator of one token of the schema
+    class Validator {
+    public:
+        Validator() = default;
+
+        explicit Validator(const json &token) {
+            name = token.value("name", "");
+            type = token.value("token_type", "string");
+            byteSize = token.value("byte_size", 0);
+            std::string rule = token.value("regex-rule", "");
+            if (! rule.empty()) {
+                dfa = Dfa(rule);
+                hasRule = true;
+                range = AsRange(dfa, lo, hi, maxLen);
+            }
+        }
+
+        // The value of the token as a string; false (with the reason in error) if it is not valid
+        bool Check(const json &value, std::string &text, std::string &error) const {
+            if (type == "string") {
+                if (! value.is_string()) {
+                    error = "The value for '" + name + "' is not a string";
+                    return false;
+                }
+                text = value.get<std::string>();
+            } else {
+                text = value.is_string() ? value.get<std::string>() : value.dump();
+            }
+
+            if (byteSize > 0 && text.size() > (size_t) byteSize) {
+                error = "The value for '" + name + "' is longer than " + std::to_string(byteSize) + " bytes";
+                return false;
+            }
+            // a token can be left out of a request, but not given without a value
+            if (text.empty()) {
+                error = "The value for '" + name + "' is missing";
+                return false;
+            }
+            if (hasRule && ! (range ? InRange(text) : dfa.Match(text))) {
+                error = "The value for '" + name + "' does not match its rule";
+                return false;
+            }
+            return true;
+        }
+
+        bool IsRange() const {
+            return range;
+        }
+
+    private:
+        bool InRange(const std::string &text) const {
+            if (text.size() > maxLen || (text.size() > 1 && text[0] == '0'))
+                return false;
+            long v = 0;
+            for (char c: text) {
+                if (c < '0' || c > '9')
+                    return false;
+                v = v * 10 + c - '0';
+            }
+            return lo <= v && v <= hi;
+        }
+
+        std::string name, type;
+        int byteSize = 0;
+        bool hasRule = false;
+        Dfa dfa;
+        bool range = false;
+        long lo = 0, hi = 0;
+        size_t maxLen = 0;
+    };
+
+    // The validators of the buffer tokens of a settings file (smartlight_settings.json)
+    class Schema {
+    public:
+        // A relative filepath is looked up in the working directory, then next to the executable
+        // (the members of a cluster run in directories of their own, see README)
+        explicit Schema(const char *filepath = "smartlight_settings.json") {
+            try {
+                std::ifstream file(filepath);
+                if (! file && filepath[0] != '/')
+                    file.open(NextToExecutable(filepath));
+                if (! file)
+                    throw "Error opening the file";
+                json tokens = json::parse(file)["input_buffers"]["settings"]["buffer-tokens"];
+                if (! tokens.is_array())
+                    throw "The file has no settings buffer-tokens";
+                for (const json &token: tokens) {
+                    std::string name = token.value("name", "");
+                    try {
+                        validators[name] = Validator(token);
+                    } catch (char const* str) {
+                        Generic::printError("The rule of the token '" + name + "' is not valid (it is not checked):\n\t" + str);
+                    }
+                }
+            } catch (char const* str) {
+                Generic::printWarn((std::string)"No settings schema was loaded from " + filepath +
+                                   ", the tokens of POST /settings are not validated:\n\t" + str);
+            } catch (...) {
+                Generic::printWarn((std::string)"No settings schema was loaded from " + filepath +
+                                   ", the tokens of POST /settings are not validated");
+            }
+        }
+
+        // The validator of a token, nullptr if the schema has none
+        const Validator* Find(const std::string &name) const {
+            auto found = validators.find(name);
+            return found == validators.end() ? nullptr : &found->second;
+        }
+
+    private:
+        static std::string NextToExecutable(const char *filepath) {
+            char path[4096];
+            ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+            if (length <= 0)
+                return filepath;
+            std::string executable(path, length);
+            return executable.substr(0, executable.rfind('/') + 1) + filepath;
+        }
+
+        std::unordered_map<std::string, Validator> validators;
+    };
+}
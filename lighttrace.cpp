@@ -0,0 +1,207 @@
+// Tracing of sampled requests: the time a request spends parsing, waiting for the lock
+// of its light, holding it, updating the model and serializing its response, kept in an
+// in-memory ring and exported in the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+// A request that is not sampled costs one thread local counter and its spans one check.
+// Included by smartlight.cpp, the same way smartlight.cpp is included by ServerMQTT.cpp
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace LightTrace {
+
+    enum Kind : uint8_t {
+        Request,
+        Parse,
+        LockWait,
+        LockHold,
+        ModelUpdate,
+        Serialize,
+        NrKinds
+    };
+
+    static const char* KindNames[NrKinds] = {"request", "parse", "lock wait", "lock hold", "model update", "serialize"};
+
+    static const uint32_t Capacity = 1 << 16; // spans kept
+    static const int      RouteSize = 48;
+
+    struct Event {
+        std::atomic<uint64_t> seq; // index + 1 once written (see lighthistory.cpp)
+        uint64_t request;
+        uint32_t thread;
+        uint8_t kind;
+        int64_t start, duration;   // microseconds since the tracer started
+        char route[RouteSize];     // Request only
+    };
+
+    class Tracer;
+
+    // The sampled request handled by this thread, if any
+    struct Context {
+        Tracer *tracer = nullptr;
+        uint64_t request = 0;
+    };
+    thread_local Context current;
+
+    inline uint32_t ThreadId() {
+        static std::atomic<uint32_t> next{1};
+        thread_local uint32_t id = next.fetch_add(1);
+        return id;
+    }
+
+    class Tracer {
+    public:
+        Tracer() : started(std::chrono::steady_clock::now()) {}
+
+        ~Tracer() {
+            delete[] events;
+        }
+
+        // Trace one request out of every `rate` (before the server is started)
+        void Enable(int rate) {
+            if (! events && rate > 0) {
+                events = new Event[Capacity];
+                for (uint32_t i = 0; i < Capacity; i++)
+                    events[i].seq.store(0, std::memory_order_relaxed);
+            }
+            this->rate.store(rate, std::memory_order_relaxed);
+        }
+
+        bool Enabled() const {
+            return rate.load(std::memory_order_relaxed) > 0;
+        }
+
+        bool Sample() {
+            int r = rate.load(std::memory_order_relaxed);
+            if (r <= 0)
+                return false;
+            thread_local uint32_t counter = 0;
+            return ++counter % r == 0;
+        }
+
+        uint64_t NextRequest() {
+            return nextRequest.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+
+        int64_t Now() const {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+        }
+
+        void Record(uint64_t request, Kind kind, int64_t start, int64_t end, const std::string &route = "") {
+            uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+            Event &event = events[index % Capacity];
+            event.seq.store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            event.request = request;
+            event.thread = ThreadId();
+            event.kind = kind;
+            event.start = start;
+            event.duration = end - start;
+            size_t length = std::min(route.size(), (size_t) RouteSize - 1);
+            memcpy(event.route, route.data(), length);
+            event.route[length] = 0;
+            event.seq.store(index + 1, std::memory_order_release);
+        }
+
+        // The spans in the ring, as a Chrome trace
+        std::string Export() const {
+            std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+            bool first = true;
+            uint64_t end = events ? head.load(std::memory_order_acquire) : 0;
+            for (uint64_t index = end > Capacity ? end - Capacity : 0; index < end; index++) {
+                const Event &event = events[index % Capacity];
+                if (event.seq.load(std::memory_order_acquire) != index + 1)
+                    continue;
+                Event copy;
+                copy.request = event.request;
+                copy.thread = event.thread;
+                copy.kind = event.kind;
+                copy.start = event.start;
+                copy.duration = event.duration;
+                memcpy(copy.route, event.route, RouteSize);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (event.seq.load(std::memory_order_relaxed) != index + 1 || copy.kind >= NrKinds)
+                    continue;
+                copy.route[RouteSize - 1] = 0;
+
+                json j;
+                j["name"] = copy.kind == Request ? (std::string) copy.route : KindNames[copy.kind];
+                j["cat"] = KindNames[copy.kind];
+                j["ph"] = "X";
+                j["ts"] = copy.start;
+                j["dur"] = copy.duration;
+                j["pid"] = 1;
+                j["tid"] = copy.thread;
+                j["args"]["request"] = copy.request;
+                out += (first ? "" : ",") + j.dump();
+                first = false;
+            }
+            return out + "]}";
+        }
+
+    private:
+        Event *events = nullptr;
+        std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> nextRequest{0};
+        std::atomic<int> rate{0};
+        std::chrono::steady_clock::time_point started;
+    };
+
+    // A span of the sampled request of the thread, from its creation to End (or its destruction)
+    class Span {
+    public:
+        explicit Span(Kind kind) : tracer(current.tracer), kind(kind) {
+            if (tracer)
+                start = tracer->Now();
+        }
+
+        ~Span() {
+            End();
+        }
+
+        void End() {
+            if (tracer)
+                tracer->Record(current.request, kind, start, tracer->Now());
+            tracer = nullptr;
+        }
+
+        Span(const Span&) = delete;
+        Span& operator= (const Span&) = delete;
+
+    private:
+        Tracer *tracer;
+        Kind kind;
+        int64_t start = 0;
+    };
+
+    // A sampled request handled by this thread while alive
+    class Scope {
+    public:
+        Scope(Tracer &tracer, const char *method, const std::string &resource) {
+            if (! tracer.Sample())
+                return;
+            sampled = true;
+            route = (std::string) method + " " + resource;
+            current.tracer = &tracer;
+            current.request = tracer.NextRequest();
+            start = tracer.Now();
+        }
+
+        ~Scope() {
+            if (! sampled)
+                return;
+            current.tracer->Record(current.request, Request, start, current.tracer->Now(), route);
+            current = Context();
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator= (const Scope&) = delete;
+
+    private:
+        bool sampled = false;
+        std::string route;
+        int64_t start = 0;
+    };
+}
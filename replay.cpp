@@ -0,0 +1,230 @@
+/*
+   Replay of a traffic capture (see lightcapture.cpp) against a local server,
+   reporting the latency and the throughput of every route.
+
+   build and run command (in cmd):
+   g++ replay.cpp -o replay -lpthread -std=c++17 -lmosquitto && ./replay capture.log
+
+   ./replay <capture> [speed] [port] [baseline]
+     speed     1 replays at the original pace (default), 2 twice as fast, 0 as fast as possible
+     port      port of the server (default 9080); MQTT goes to the broker on localhost:1883
+     baseline  results of a previous replay, to print the differences against
+
+   The results are saved to replay_results.json, to be used as the baseline of the next build.
+
+   All the requests come from this one address: start the server with limits the capture fits in
+   (for example ./server 9080 2 clientrate=100000 lightrate=100000), or the requests over them are
+   answered 429 Too Many Requests and reported as such.
+*/
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mosquitto.h>
+#include <nlohmann/json.hpp>
+
+#include "lightcapture.cpp"
+#include "lightclient.cpp"
+
+using namespace std;
+using json = nlohmann::json;
+using Clock = chrono::steady_clock;
+
+// Number of persistent HTTP connections the requests are spread on
+static const int Connections = 8;
+
+struct Job {
+    const LightCapture::Entry *entry;
+    Clock::time_point due; // when the request should have been sent
+};
+
+struct Sample {
+    string route;
+    int status;
+    double latency; // ms, from when the request was due (includes the time spent queued)
+};
+
+// The route of a request: method and first segment of the resource (POST /rgb)
+string RouteOf(const LightCapture::Entry &entry) {
+    size_t end = entry.target.find('/', 1);
+    return (string) LightCapture::Methods[entry.method] + " " + entry.target.substr(0, end);
+}
+
+double Percentile(vector<double> &values, double p) {
+    if (values.empty())
+        return 0;
+    size_t k = min(values.size() - 1, (size_t) (p / 100 * values.size()));
+    nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+}
+
+json Summarize(const vector<Sample> &samples, double seconds) {
+    map<string, vector<double>> latencies;
+    map<string, int> errors;
+    for (const Sample &s: samples) {
+        latencies[s.route].push_back(s.latency);
+        latencies["all"].push_back(s.latency);
+        if (s.status < 200 || s.status >= 300) {
+            errors[s.route]++;
+            errors["all"]++;
+        }
+    }
+
+    json j;
+    for (auto &route: latencies) {
+        json r;
+        r["requests"] = route.second.size();
+        r["errors"] = errors[route.first];
+        r["throughput"] = seconds > 0 ? route.second.size() / seconds : 0;
+        r["p50"] = Percentile(route.second, 50);
+        r["p90"] = Percentile(route.second, 90);
+        r["p99"] = Percentile(route.second, 99);
+        r["max"] = *max_element(route.second.begin(), route.second.end());
+        j[route.first] = r;
+    }
+    return j;
+}
+
+void Print(const json &results, const json &baseline) {
+    cout << left << setw(18) << "route" << right << setw(9) << "requests" << setw(8) << "errors"
+         << setw(12) << "req/s" << setw(10) << "p50 ms" << setw(10) << "p90 ms" << setw(10) << "p99 ms"
+         << setw(10) << "max ms" << endl;
+    for (auto &route: results.items()) {
+        const json &r = route.value();
+        cout << left << setw(18) << route.key() << right << setw(9) << r["requests"].get<int>()
+             << setw(8) << r["errors"].get<int>() << fixed << setprecision(1);
+        for (const char *key: {"throughput", "p50", "p90", "p99", "max"})
+            cout << setw(key == string("throughput") ? 12 : 10) << r[key].get<double>();
+        cout << endl;
+
+        if (baseline.contains(route.key())) {
+            // relative differences: negative latencies and positive throughput are improvements
+            const json &b = baseline[route.key()];
+            cout << left << setw(35) << "  vs baseline" << right;
+            for (const char *key: {"throughput", "p50", "p90", "p99", "max"}) {
+                double before = b[key].get<double>(), now = r[key].get<double>();
+                string delta = before > 0 ? (now >= before ? "+" : "") + to_string((int) lround(100 * (now - before) / before)) + "%" : "-";
+                cout << setw(key == string("throughput") ? 12 : 10) << delta;
+            }
+            cout << endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        cerr << "usage: " << argv[0] << " <capture> [speed] [port] [baseline]" << endl;
+        return 1;
+    }
+    double speed = argc >= 3 ? stod(argv[2]) : 1;
+    int port = argc >= 4 ? stoi(argv[3]) : 9080;
+
+    vector<LightCapture::Entry> entries;
+    json baseline = json::object();
+    try {
+        LightCapture::Reader reader(argv[1]);
+        LightCapture::Entry entry;
+        while (reader.Next(entry))
+            entries.push_back(entry);
+        if (argc >= 5) {
+            ifstream file(argv[4]);
+            baseline = json::parse(file);
+        }
+    } catch (char const* str) {
+        cerr << str << endl;
+        return 1;
+    } catch (...) {
+        cerr << "The baseline could not be read" << endl;
+        return 1;
+    }
+
+    mosquitto_lib_init();
+    struct mosquitto *mosq = mosquitto_new(nullptr, true, nullptr);
+    bool mqtt = mosq && mosquitto_connect(mosq, "localhost", 1883, 10) == MOSQ_ERR_SUCCESS;
+    if (mqtt)
+        mosquitto_loop_start(mosq);
+    else
+        cerr << "Could not connect to the broker, the MQTT messages are skipped" << endl;
+
+    mutex lock;
+    condition_variable wakeup;
+    deque<Job> queue;
+    vector<Sample> samples;
+    bool done = false;
+
+    vector<thread> workers;
+    for (int i = 0; i < Connections; i++) {
+        workers.emplace_back([&] {
+            LightClient::Connection connection("127.0.0.1", port);
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                wakeup.wait(guard, [&] { return done || ! queue.empty(); });
+                if (queue.empty())
+                    return;
+                Job job = queue.front();
+                queue.pop_front();
+                guard.unlock();
+
+                const LightCapture::Entry &entry = *job.entry;
+                int status = connection.Send(LightCapture::Methods[entry.method], entry.target, entry.payload);
+                double latency = chrono::duration<double, milli>(Clock::now() - job.due).count();
+
+                guard.lock();
+                samples.push_back({RouteOf(*job.entry), status, latency});
+            }
+        });
+    }
+
+    // send every entry when it is due (at the pace of the capture divided by speed)
+    Clock::time_point start = Clock::now();
+    for (const LightCapture::Entry &entry: entries) {
+        Clock::time_point due = start;
+        if (speed > 0) {
+            due += chrono::microseconds((long long) (entry.time / speed));
+            this_thread::sleep_until(due);
+        }
+        if (entry.type == LightCapture::Http) {
+            lock_guard<mutex> guard(lock);
+            queue.push_back({&entry, due});
+            wakeup.notify_one();
+        } else if (mqtt) {
+            mosquitto_publish(mosq, nullptr, entry.target.c_str(), (int) entry.payload.size(), entry.payload.data(), 1, false);
+        }
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        done = true;
+        wakeup.notify_all();
+    }
+    for (thread &t: workers)
+        t.join();
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    if (mqtt) {
+        mosquitto_disconnect(mosq);
+        mosquitto_loop_stop(mosq, true);
+    }
+    mosquitto_destroy(mosq);
+    mosquitto_lib_cleanup();
+
+    json results = Summarize(samples, seconds);
+    cout << "Replayed " << entries.size() << " entries in " << fixed << setprecision(2) << seconds << "s" << endl;
+    Print(results, baseline);
+
+    long limited = count_if(samples.begin(), samples.end(), [](const Sample &s) { return s.status == 429; });
+    if (limited > 0)
+        cerr << limited << " requests were refused by the limits of the server (429), all of them come from this address:"
+             << " start the server with higher clientrate= and lightrate= to replay the capture" << endl;
+
+    ofstream("replay_results.json") << results.dump(4) << endl;
+    return 0;
+}
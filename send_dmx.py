@@ -0,0 +1,49 @@
+# Local DMX generator: sends E1.31 (sACN) or Art-Net frames of a slow color wheel
+# to a server started with dmx=dmx_patch_sample.json, at the rate of a console.
+#
+#   python3 send_dmx.py [universes=2] [seconds=10] [sacn|artnet] [host=127.0.0.1]
+
+import colorsys
+import socket
+import struct
+import sys
+import time
+import uuid
+
+UNIVERSES = int(sys.argv[1]) if len(sys.argv) > 1 else 2
+SECONDS = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+PROTOCOL = sys.argv[3] if len(sys.argv) > 3 else 'sacn'
+HOST = sys.argv[4] if len(sys.argv) > 4 else '127.0.0.1'
+RATE = 44  # frames per second of every universe
+CID = uuid.uuid4().bytes
+
+
+def e131(universe, sequence, data):
+    dmp = struct.pack('>HBBHHH', 0x7000 | (10 + len(data) + 1), 0x02, 0xa1, 0, 1, len(data) + 1) + b'\x00' + data
+    framing = struct.pack('>HI', 0x7000 | (77 + len(dmp)), 0x02) + b'send_dmx.py'.ljust(64, b'\x00') + \
+        struct.pack('>BHBBH', 100, 0, sequence, 0, universe) + dmp
+    root = struct.pack('>HH', 0x0010, 0) + b'ASC-E1.17\x00\x00\x00' + \
+        struct.pack('>HI', 0x7000 | (22 + len(framing)), 0x04) + CID + framing
+    return root
+
+
+def artnet(universe, sequence, data):
+    return b'Art-Net\x00' + struct.pack('<H', 0x5000) + struct.pack('>HBBBBH', 14, sequence, 0,
+                                                                     universe & 0xff, universe >> 8, len(data)) + data
+
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+port = 5568 if PROTOCOL == 'sacn' else 6454
+start = time.time()
+frames = 0
+while time.time() - start < SECONDS:
+    sequence = frames % 256
+    for universe in range(1, UNIVERSES + 1):
+        r, g, b = colorsys.hsv_to_rgb(((time.time() - start) / 5 + universe / UNIVERSES) % 1, 1, 1)
+        # R, G, B and dimmer over and over: every patched light gets the color of its universe
+        data = bytes([int(r * 255), int(g * 255), int(b * 255), 255] * 128)
+        packet = e131(universe, sequence, data) if PROTOCOL == 'sacn' else artnet(universe, sequence, data)
+        sock.sendto(packet, (HOST, port))
+    frames += 1
+    time.sleep(max(0, start + frames / RATE - time.time()))
+print('Sent', frames, 'frames of', UNIVERSES, 'universes in', round(time.time() - start, 1), 'seconds')
@@ -28,6 +28,8 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
 using namespace std;
 using namespace Pistache;
@@ -81,6 +83,21 @@ namespace Generic {
 
 using namespace Generic;
 
+#include "lightcolor.cpp"
+#include "lightmusic.cpp"
+#include "lightio.cpp"
+#include "lightlimit.cpp"
+#include "lighthistory.cpp"
+#include "lightcapture.cpp"
+#include "lightclient.cpp"
+#include "lightcluster.cpp"
+#include "lightreplica.cpp"
+#include "lightschema.cpp"
+#include "lightrules.cpp"
+#include "lighttrace.cpp"
+#include "lightcontrol.cpp"
+#include "lightdmx.cpp"
+
 int    alertCounter = 0;
 int    fdSConfig    = -1;
 char * mapSConfig   = (char *) MAP_FAILED;
@@ -88,17 +105,285 @@ char * mapSConfig   = (char *) MAP_FAILED;
 // Definition of the SmartLightEnpoint class 
 class SmartLightEndpoint {
 public:
-    explicit SmartLightEndpoint(Address addr)
-        : httpEndpoint(std::make_shared<Http::Endpoint>(addr))
+    // A replica maps the SettingConfigs.data of the server running in the same directory
+    // read-only and only answers the requests reading the lights (see setupRoutes).
+    // The file is mapped by activate().
+    explicit SmartLightEndpoint(Address addr, bool replica = false)
+        : history(MaxSmartLights), replica(replica), address(addr)
     {   
         alertCounter = 0;
         fdSConfig  = -1;
         mapSConfig = (char *) MAP_FAILED;
+
+        // the automation rules saved by POST /rules, if any
+        std::ifstream rulesFile(RulesFile);
+        if (rulesFile && ! replica) {
+            try {
+                automation.Load(json::parse(rulesFile));
+            } catch (const string& str) {
+                printError("Error in loading the automation rules:\n\t" + str);
+            } catch (...) {
+                printError("Error in loading the automation rules");
+            }
+        }
+    }
+
+    ~SmartLightEndpoint() {   
+        try {
+            // the reactive sessions and the I/O callbacks write into the lights, stop them before unmapping
+            StopClock();
+            if (control)
+                control->Stop();
+            if (dmx)
+                dmx->Stop();
+            ioExecutor.Stop();
+            if (forwarder)
+                forwarder->Stop();
+            musicPool.Stop();
+            if (fdSConfig != -1) {
+                if (mapSConfig != MAP_FAILED)
+                    munmap (mapSConfig, MaxSmartLights * sizeof(Slot));
+                close(fdSConfig);
+            }
+        } catch (...) {
+            printError("Error in deleting the Shared Memory Map");
+        }
+        alertCounter = 0;
+        fdSConfig    = -1;
+        mapSConfig   = (char *) MAP_FAILED;
+    }
+
+    // Initialization of the server. Additional options can be provided here
+    // With more than one listener, every listener is an endpoint of its own,
+    // bound to the same port and pinned to its own core (see start). A listener is not tied to
+    // any shard of the lights: a connection carries the requests of any light.
+    // reusePort lets a new server bind the same port while this one hands over (hot restart)
+    // and the listeners of this server share it (the kernel balances the connections); without it
+    // a second server started on the port by mistake fails to bind instead of sharing it.
+    void init(size_t thr = 2, size_t listeners = 1, bool reusePort = false) {
+        // the control channel and DMX share their ports for a hot restart only (see activate)
+        this->reusePort = reusePort;
+        Flags<Tcp::Options> flags = reusePort || listeners > 1
+            ? Tcp::Options::ReuseAddr | Tcp::Options::ReusePort
+            : Flags<Tcp::Options>(Tcp::Options::ReuseAddr);
+        auto opts = Http::Endpoint::options()
+            .threads(static_cast<int>(thr))
+            .flags(flags);
+        for (size_t i = 0; i < std::max<size_t>(1, listeners); i++) {
+            httpEndpoints.push_back(std::make_shared<Http::Endpoint>(address));
+            httpEndpoints.back()->init(opts);
+        }
+        // Server routes are loaded up
+        setupRoutes();
+    }
+
+    // Record an impact alert received over MQTT in the history of a light (id -1 for all of them)
+    // and run the automation rules over it
+    void recordImpact(int id, int value) {
+        for (int i = 0; i < MaxSmartLights; i++) {
+            if (id != -1 && id != i)
+                continue;
+            history.Append(i, LightHistory::Impact, value);
+            if (! Owns(i))
+                continue;
+            LightGuard guard(*this, i, LightGuard::Read);
+            if (slots[i].light.IsInit())
+                Automate(i, LightRules::Impact, value);
+        }
+    }
+
+    // Capture the HTTP requests and the MQTT messages to the file at path (before the server is started)
+    void startCapture(const string& path) {
+        recorder.reset(new LightCapture::Recorder(path));
+    }
+
+    void recordMqtt(const string& topic, const string& payload) {
+        if (recorder)
+            recorder->RecordMqtt(topic, payload);
+    }
+
+    // Trace one request out of every `rate` (before the server is started, see GET /trace)
+    void setTracing(int rate) {
+        tracer.Enable(rate);
+    }
+
+    // Rate and queue depth limits of the requests (before the server is started)
+    void setLimits(const LightLimit::Config& config) {
+        limiter.Configure(config);
+    }
+
+    // Cluster mode (before the server is started): the lights are partitioned between the members
+    // by consistent hashing, the requests for the lights of the other members are forwarded to them.
+    // self is the "host:port" the other members reach this server at. A server joining a running
+    // cluster starts with the seed as only member, so it owns no light until it joined (see joinCluster).
+    // The members authenticate the requests they send each other with secret (see FromMember).
+    void enableCluster(const string& self, const std::vector<string>& members, const string& secret) {
+        this->self = self;
+        this->clusterSecret = secret;
+        forwarder.reset(new LightCluster::Forwarder());
+        std::atomic_store(&ring, std::make_shared<const LightCluster::Ring>(members));
+    }
+
+    // Control channel (before the server is started, not on replicas): WebSocket clients on port set the
+    // color and luminosity of the lights with binary messages and get the changes of the lights pushed
+    // back (see lightcontrol.cpp). Browsers can only connect from the pages of origins ("http://host:port").
+    // The port is opened by activate().
+    void enableControl(int port, const std::vector<string>& origins) {
+        controlPort = port;
+        control.reset(new LightControl::Server(MaxSmartLights,
+            [this](const std::vector<LightControl::Update>& updates) {
+                ControlLights(updates);
+            },
+            [this](int id, LightControl::State& state) {
+                SmartLight sl;
+                if (! Snapshot(id, sl, state.version) || ! sl.IsInit())
+                    return false;
+                state.R = sl.GetR();
+                state.G = sl.GetG();
+                state.B = sl.GetB();
+                state.luminosity = sl.GetLuminosity();
+                return true;
+            }, origins));
+    }
+
+    // DMX over UDP (before the server is started, not on replicas): the E1.31 and Art-Net frames of
+    // lighting consoles set the lights patched on their universes by the patch file at path
+    // (see lightdmx.cpp). Throws a message if the patch is not valid, its ports are opened by activate().
+    void enableDmx(const string& path) {
+        std::ifstream file(path);
+        if (! file)
+            throw "The DMX patch could not be read";
+        json patch;
+        try {
+            patch = json::parse(file);
+        } catch (...) {
+            throw "The DMX patch is not valid JSON";
+        }
+        try {
+            dmx.reset(new LightDmx::Receiver(patch, MaxSmartLights, [this](const std::vector<LightDmx::Change>& changes) {
+                DmxLights(changes);
+            }));
+        } catch (const json::exception&) {
+            throw "The DMX patch has a light without its id, universe or address";
+        }
+    }
+
+    // Join a running cluster through one of its members (after the server is activated,
+    // so the lights moving to this server can be received). false if the seed did not answer.
+    bool joinCluster(const string& seed) {
+        string host, body;
+        int port;
+        if (! LightCluster::ParseNode(seed, host, port))
+            return false;
+        LightClient::Connection connection(host, port);
+        if (connection.Send("POST", "/cluster/join/" + self, "", &body, MemberHeaders()) != 200)
+            return false;
+        try {
+            SetMembers(json::parse(body)["members"].get<std::vector<string>>());
+        } catch (...) {
+            return false;
+        }
+        return true;
+    }
+
+    // Server is started threaded. The requests wait for activate() (see Track), so a new server can
+    // listen on the port before the server it replaces stopped changing the lights.
+    void start() {
+        cpu_set_t original;
+        pthread_getaffinity_np(pthread_self(), sizeof(original), &original);
+        int cores = std::max(1, (int) std::thread::hardware_concurrency());
+
+        for (size_t i = 0; i < httpEndpoints.size(); i++) {
+            // the threads of the endpoint inherit the affinity of the thread that starts it
+            if (httpEndpoints.size() > 1) {
+                cpu_set_t core;
+                CPU_ZERO(&core);
+                CPU_SET(i % cores, &core);
+                pthread_setaffinity_np(pthread_self(), sizeof(core), &core);
+            }
+            httpEndpoints[i]->setHandler(router.handler());
+            httpEndpoints[i]->serveThreaded();
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(original), &original);
+    }
+
+    // Start changing the lights (after start, and after the server it replaces handed over):
+    // the lights of the file, their history and outputs, the clock of the rules, the control channel and DMX,
+    // then the requests waiting in Track are let through. false if the file cannot be used.
+    bool activate() {
+        if (! MapLights())
+            return false;
+        if (! replica) {
+            history.Open("History.data");
+            for (int id = 0; id < MaxSmartLights; id++) {
+                // this server is the only writer of the file now
+                LightReplica::Repair(slots[id].seq);
+                // the lights restored from the file start with their converted output
+                if (slots[id].light.IsInit())
+                    UpdateOutput(id);
+            }
+            clock = std::thread(&SmartLightEndpoint::Tick, this);
+            try {
+                if (control)
+                    control->Start(controlPort, reusePort);
+                if (dmx)
+                    dmx->Start(reusePort);
+            } catch (char const* str) {
+                printError(str);
+            }
+        }
+        std::lock_guard<std::mutex> guard(activeLock);
+        active = true;
+        activeChanged.notify_all();
+        return true;
+    }
+
+    // When signaled server shuts down
+    void stop(){
+        StopWriters();
+        for (auto &endpoint: httpEndpoints)
+            endpoint->shutdown();
+    }
+
+    // Hot restart: the requests arriving from now on are refused (503), the ones being handled finish
+    // (for at most `timeout`) and everything changing the lights is stopped. The new server, listening
+    // on the same port, only starts changing the lights after this (see activate), so the file always has
+    // a single writer. The endpoints stay up until stop() so the responses in flight are sent.
+    void handOver(std::chrono::milliseconds timeout = std::chrono::milliseconds(5000)) {
+        handingOver = true;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        // the wrappers first: a request holds its I/O (limiter.Hold) before its wrapper returns
+        auto busy = [this] { return wrapped > 0 || limiter.InFlight() > 0; };
+        while (busy() && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (busy())
+            printWarn("Handing over with " + std::to_string(std::max<int>(wrapped, limiter.InFlight())) +
+                      " requests still in flight");
+        StopWriters();
+    }
+
+private:
+    using Handler = void (SmartLightEndpoint::*)(const Rest::Request&, Http::ResponseWriter);
+
+    /** Map the lights of SettingConfigs.data, read-only in a replica. The writing server creates the
+     *  file if there is none and migrates a file of an older layout in place (see Migrate).
+     *  @return false if the file cannot be used (the server must not run without it)
+     **/
+    bool MapLights() {
         try {
-            const char* filepath = "SettingConfigs.data";
-            //printDebug(to_string(MaxSmartLights * sizeof(SmartLight)));
+            const char* filepath = LightsFile;
+            //printDebug(to_string(MaxSmartLights * sizeof(Slot)));
+
+            if (replica) {
+                std::atomic_store(&mapping, MapReplica());
+                slots = mapping->slots;
+                return true;
+            }
             
-            fdSConfig = open(filepath, O_RDWR, (mode_t)0600);
+            // the layout of the records changed with the versions of the server
+            Migrate(filepath);
+
+            fdSConfig = open(filepath, O_RDWR | O_CREAT, (mode_t)0600);
 
             if (fdSConfig == -1)
                 throw "Error opening the file";
@@ -108,7 +393,14 @@ public:
             if (fstat(fdSConfig, &fileInfo) == -1)
                 throw "Error getting the file size";
 
-            if (fileInfo.st_size != MaxSmartLights * sizeof(SmartLight))
+            // a new installation starts with no light
+            if (fileInfo.st_size == 0) {
+                if (ftruncate(fdSConfig, MaxSmartLights * sizeof(Slot)) != 0)
+                    throw "Error creating the file";
+                fileInfo.st_size = MaxSmartLights * sizeof(Slot);
+            }
+
+            if (fileInfo.st_size != MaxSmartLights * sizeof(Slot))
                 throw "Error missmatching between the file size and the to be mapped object size";
 
             mapSConfig = (char *) mmap(0, fileInfo.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fdSConfig, 0);
@@ -126,75 +418,811 @@ public:
             //cout << ((SmartLight*) mapSConfig)[0].Repr() << endl;
             // */
 
-            smartLights = (SmartLight*) mapSConfig;
+            slots = (Slot*) mapSConfig;
+            return true;
         } catch (char const* str) {
             printError((string)"Error in creating the Shared Memory Map:\n\t" + str);
-            if (fdSConfig != -1)
-                close(fdSConfig);
-            fdSConfig = -1;
-            smartLights = new SmartLight[MaxSmartLights];
         } catch (...) {
             printError("Error in creating the Shared Memory Map");
-            smartLights = new SmartLight[MaxSmartLights];
+        }
+        // without the file the lights would not be kept (nor be those of the server, for a replica)
+        if (fdSConfig != -1)
+            close(fdSConfig);
+        fdSConfig = -1;
+        return false;
+    }
+
+    // The layouts of the records of SettingConfigs.data before this one: the size of a record
+    // and the offset of its SmartLight (the first layout only had the SmartLight)
+    struct Layout {
+        size_t record, light;
+    };
+
+    /** Rewrite a file of an older layout in the current one (the lights keep their settings and
+     *  their sequences start over). A file of any other size is left as it is.
+     *  The versions start from the time of the migration (in seconds), above any version given before.
+     **/
+    void Migrate(const char* filepath) {
+        // then the sequence of the replicas (see lightreplica.cpp) was added before the SmartLight
+        static_assert(alignof(SmartLight) <= sizeof(uint32_t), "the SmartLight followed the sequence");
+        static const Layout layouts[] = {{sizeof(SmartLight), 0},
+                                         {sizeof(uint32_t) + sizeof(SmartLight), sizeof(uint32_t)}};
+        struct stat fileInfo = {0};
+        if (stat(filepath, &fileInfo) != 0)
+            return;
+        for (const Layout& layout: layouts) {
+            if ((size_t) fileInfo.st_size != MaxSmartLights * layout.record)
+                continue;
+            std::vector<char> old(fileInfo.st_size);
+            std::ifstream in(filepath, std::ifstream::binary);
+            if (! in.read(old.data(), old.size()))
+                throw "Error reading the file to migrate";
+            std::vector<Slot> migrated(MaxSmartLights);
+            for (int id = 0; id < MaxSmartLights; id++) {
+                memcpy((void *) &migrated[id].light, old.data() + id * layout.record + layout.light, sizeof(SmartLight));
+                // the versions were not kept in these layouts, counted from 0 by every server started
+                migrated[id].version = (uint32_t) std::time(nullptr);
+            }
+
+            // written aside then renamed over the file, an interrupted migration leaves the old file
+            string temporary = (string) filepath + ".migrating";
+            int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+            if (fd == -1)
+                throw "Error creating the migrated file";
+            size_t size = MaxSmartLights * sizeof(Slot);
+            bool written = write(fd, (const void *) migrated.data(), size) == (ssize_t) size && fsync(fd) == 0;
+            close(fd);
+            if (! written || rename(temporary.c_str(), filepath) != 0) {
+                unlink(temporary.c_str());
+                throw "Error writing the migrated file";
+            }
+            printInfo((string) filepath + " was migrated from records of " + std::to_string(layout.record) +
+                      " bytes to records of " + std::to_string(sizeof(Slot)) + " bytes");
+            return;
+        }
+    }
+
+    // Everything changing the lights other than the HTTP requests
+    void StopWriters() {
+        StopClock();
+        if (control)
+            control->Stop();
+        if (dmx)
+            dmx->Stop();
+        // the pending file I/O still sends its responses before the endpoints go down
+        ioExecutor.Stop();
+        if (forwarder)
+            forwarder->Stop();
+        musicPool.Stop();
+    }
+
+    // Wait for activate() (for at most `timeout`); false if the server is still not active
+    bool WaitActive(std::chrono::milliseconds timeout = std::chrono::milliseconds(10000)) {
+        if (active)
+            return true;
+        std::unique_lock<std::mutex> guard(activeLock);
+        return activeChanged.wait_for(guard, timeout, [this] { return active.load(); });
+    }
+
+    // Counts a request from the moment it reaches Track until the wrapper returns (see handOver)
+    class Handling {
+    public:
+        explicit Handling(std::atomic<int> &count) : count(count) {
+            ++count;
+        }
+
+        ~Handling() {
+            --count;
+        }
+
+    private:
+        std::atomic<int> &count;
+    };
+
+    // Bind a handler behind the admission control and count it as in flight while it runs (see handOver).
+    // lightWrite handlers change the light of their :id and are limited per light as well.
+    Rest::Route::Handler Track(Handler handler, bool lightWrite = false) {
+        return [this, handler, lightWrite](const Rest::Request request, Http::ResponseWriter response) {
+            // counted before handingOver is checked, so handOver either waits for this request or it is refused
+            Handling handling(wrapped);
+
+            // during a hot restart only one of the two servers changes the lights at a time
+            if (handingOver || ! WaitActive()) {
+                response.headers().addRaw(Http::Header::Raw("Retry-After", "1"));
+                response.send(Http::Code::Service_Unavailable, "The server is being replaced, try again\n");
+                return Rest::Route::Result::Ok;
+            }
+
+            LightTrace::Scope trace(tracer, Http::methodString(request.method()), request.resource());
+
+            // the capture holds the traffic as it arrived, including what the limits reject
+            if (recorder)
+                recorder->RecordHttp(Http::methodString(request.method()), request.resource(), request.body());
+
+            int light = -1;
+            if (lightWrite && request.hasParam(":id"))
+                light = (int) strtol(request.param(":id").as<std::string>().c_str(), nullptr, 10);
+
+            // a forwarded request is limited as a request of the client it was forwarded for
+            // (only another member can forward a request)
+            bool forwarded = ! HeaderOf(request, LightCluster::ForwardedHeader).empty() && FromMember(request);
+            string client = forwarded ? HeaderOf(request, LightCluster::ClientHeader) : request.address().host();
+
+            switch (limiter.Admit(client, light)) {
+            case LightLimit::Verdict::Accepted:
+                break;
+            case LightLimit::Verdict::Overloaded:
+                Reject(response, "The server is overloaded\n");
+                return Rest::Route::Result::Ok;
+            case LightLimit::Verdict::ClientLimited:
+                Reject(response, "Too many requests\n");
+                return Rest::Route::Result::Ok;
+            case LightLimit::Verdict::LightLimited:
+                Reject(response, "Too many changes of this smart light\n");
+                return Rest::Route::Result::Ok;
+            }
+
+            auto members = std::atomic_load(&ring);
+            if (members && ! forwarded) {
+                int owned = LightOf(request);
+                if (owned >= 0 && owned < MaxSmartLights && members->Owner(owned) != self) {
+                    Forward(members->Owner(owned), owned, client, request, std::move(response));
+                    limiter.Release();
+                    return Rest::Route::Result::Ok;
+                }
+            }
+
+            // the handlers catch their own errors, so the request is always released
+            (this->*handler)(request, std::move(response));
+            limiter.Release();
+            return Rest::Route::Result::Ok;
+        };
+    }
+
+    static void Reject(Http::ResponseWriter &response, const string &message) {
+        response.headers().addRaw(Http::Header::Raw("Retry-After", "1"));
+        response.send(Http::Code::Too_Many_Requests, message);
+    }
+
+    // Value of a header of the request, empty if it has none
+    static string HeaderOf(const Rest::Request& request, const string& name) {
+        const auto& raw = request.headers().rawList();
+        auto found = raw.find(name);
+        return found == raw.end() ? "" : found->second.value();
+    }
+
+    static string ETagOf(int id, uint32_t version) {
+        return "\"" + std::to_string(id) + "-" + std::to_string(version) + "\"";
+    }
+
+    // Whether an If-Match or If-None-Match list ("*" or ETags separated by commas) has etag
+    static bool ListHas(const string& list, const string& etag) {
+        for (size_t start = 0, end; start < list.size(); start = end + 1) {
+            end = std::min(list.find(',', start), list.size());
+            string item = list.substr(start, end - start);
+            item.erase(0, item.find_first_not_of(" \t"));
+            item.erase(item.find_last_not_of(" \t") + 1);
+            if (item.rfind("W/", 0) == 0)
+                item.erase(0, 2);
+            if (item == "*" || item == etag)
+                return true;
+        }
+        return false;
+    }
+
+    // Conditional GET: tag the response with the version of the light, and answer
+    // 304 Not Modified (nothing serialized) if the client has that version already.
+    // true if the response was sent
+    static bool NotModified(const Rest::Request& request, Http::ResponseWriter& response, int id, uint32_t version) {
+        string etag = ETagOf(id, version);
+        response.headers().addRaw(Http::Header::Raw("ETag", etag));
+        if (! ListHas(HeaderOf(request, "If-None-Match"), etag))
+            return false;
+        response.send(Http::Code::Not_Modified);
+        return true;
+    }
+
+    // Optimistic concurrency: a change with If-Match is only made to the version of the light the
+    // client read; false (after answering 412) if the light was changed since.
+    // Must be called while holding the LightGuard of the light.
+    bool Precondition(const Rest::Request& request, Http::ResponseWriter& response, int id) {
+        string ifMatch = HeaderOf(request, "If-Match");
+        string etag = ETagOf(id, slots[id].version);
+        if (ifMatch.empty() || ListHas(ifMatch, etag))
+            return true;
+        response.headers().addRaw(Http::Header::Raw("ETag", etag));
+        response.send(Http::Code::Precondition_Failed, "This smart light was changed since it was read\n");
+        return false;
+    }
+
+    // Tag the response to a change with the new version of the light
+    static void Tag(Http::ResponseWriter& response, int id, uint32_t version) {
+        response.headers().addRaw(Http::Header::Raw("ETag", ETagOf(id, version)));
+    }
+
+    // The light a request is about: its :id, or the id in the body of POST /settings (-1 if none)
+    static int LightOf(const Rest::Request& request) {
+        if (request.hasParam(":id"))
+            return (int) strtol(request.param(":id").as<std::string>().c_str(), nullptr, 10);
+        if (request.method() == Http::Method::Post && request.resource() == "/settings") {
+            try {
+                return std::stoi((string) json::parse(request.body())["input_buffers"]["settings"]["id"]);
+            } catch (...) {
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    // Whether a request was sent by another member of the cluster (it has the secret of the cluster)
+    bool FromMember(const Rest::Request& request) {
+        return ! clusterSecret.empty() &&
+               LightCluster::SameSecret(HeaderOf(request, LightCluster::SecretHeader), clusterSecret);
+    }
+
+    // The header lines of the requests sent to the other members
+    string MemberHeaders() {
+        return (string) LightCluster::ForwardedHeader + ": 1\r\n" + LightCluster::SecretHeader + ": " + clusterSecret + "\r\n";
+    }
+
+    // Refuse a /cluster change that was not sent by a member (or by an administrator with the secret); true if refused
+    bool NotFromMember(const Rest::Request& request, Http::ResponseWriter& response) {
+        if (FromMember(request))
+            return false;
+        response.send(Http::Code::Forbidden, "Only the members of the cluster can do this\n");
+        return true;
+    }
+
+    // Send a request to the member owning its light and answer with the response of that member
+    void Forward(const string& node, int id, const string& client, const Rest::Request& request, Http::ResponseWriter response) {
+        auto writer = std::make_shared<Http::ResponseWriter>(std::move(response));
+        string headers = MemberHeaders() + LightCluster::ClientHeader + ": " + client + "\r\n";
+        for (const char *name: {"If-Match", "If-None-Match"}) {
+            string value = HeaderOf(request, name);
+            if (! value.empty())
+                headers += (string) name + ": " + value + "\r\n";
+        }
+        limiter.Hold();
+        forwarder->Forward(id, node, Http::methodString(request.method()), request.resource(), request.body(), headers,
+                           [this, node, writer](int status, const string& body, const LightCluster::Headers& relayed) {
+            try {
+                if (status == -1)
+                    writer->send(Http::Code::Bad_Gateway, "The server " + node + " owning this smart light is unavailable\n");
+                else {
+                    // the ETag of the light, and when to try again after a 429 or 503 of the member
+                    for (const auto& header: relayed)
+                        writer->headers().addRaw(Http::Header::Raw(header.first, header.second));
+                    writer->send(static_cast<Http::Code>(status), body);
+                }
+            } catch (...) {
+                printError("The response forwarded from " + node + " could not be sent");
+            }
+            limiter.Release();
+        });
+    }
+
+    /** Change the members of the cluster and move the lights this server no longer owns to their new owners
+     *  @param members The "host:port" of every member
+     **/
+    void SetMembers(const std::vector<string>& members) {
+        std::lock_guard<std::mutex> guard(clusterLock);
+        ChangeMembers(members);
+    }
+
+    /** Add a member to the cluster, as SetMembers (the members are read and changed under the same
+     *  lock, so servers joining at the same time are all kept)
+     *  @param node The "host:port" of the new member
+     *  @return The members with node among them
+     **/
+    std::vector<string> AddMember(const string& node) {
+        std::lock_guard<std::mutex> guard(clusterLock);
+        std::vector<string> nodes = std::atomic_load(&ring)->Nodes();
+        if (std::find(nodes.begin(), nodes.end(), node) == nodes.end())
+            nodes.push_back(node);
+        ChangeMembers(nodes);
+        return std::atomic_load(&ring)->Nodes();
+    }
+
+    // SetMembers, while holding clusterLock
+    void ChangeMembers(std::vector<string> members) {
+        if (std::find(members.begin(), members.end(), self) == members.end())
+            members.push_back(self);
+        auto before = std::atomic_load(&ring);
+        auto after = std::make_shared<const LightCluster::Ring>(members);
+
+        // the lights are queued to their new owners before the new members are published, so the
+        // requests this server forwards for them from then on are sent after them (see Forwarder)
+        for (int id = 0; before && id < MaxSmartLights; id++) {
+            if (before->Owner(id) != self || after->Owner(id) == self)
+                continue;
+            string body;
+            {
+                LightGuard lightGuard(*this, id, LightGuard::Read);
+                if (! slots[id].light.IsInit())
+                    continue;
+                json j;
+                slots[id].light.ExportToJson(j);
+                slots[id].light.ExportAlarms(j["alarms"]);
+                j["automation"] = automation.ExportState(id);
+                j["version"] = slots[id].version;
+                body = j.dump();
+            }
+            string node = after->Owner(id);
+            forwarder->Forward(id, node, "PUT", "/cluster/light/" + std::to_string(id), body,
+                               MemberHeaders(), [node, id](int status, const string&, const LightCluster::Headers&) {
+                if (status != 200)
+                    printError("The smart light " + std::to_string(id) + " could not be moved to " + node);
+            });
+        }
+        std::atomic_store(&ring, after);
+        printInfo("Cluster members: " + json(after->Nodes()).dump());
+    }
+
+    /** Get the members of the cluster and the owner of every SmartLight
+     *  Example of HTTP call:
+     *  curl -X GET http://localhost:9080/cluster
+     **/
+    void GetCluster(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            auto members = std::atomic_load(&ring);
+            if (! members) {
+                response.send(Http::Code::Bad_Request, "The server is not in a cluster\n");
+                return;
+            }
+            json j;
+            j["self"] = self;
+            j["members"] = members->Nodes();
+            for (int id = 0; id < MaxSmartLights; id++)
+                j["owners"][std::to_string(id)] = members->Owner(id);
+            response.send(Http::Code::Ok, j.dump(4) + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
+    /** Add a server to the cluster; the other members are told about it and move it its lights
+     *  @param node The "host:port" of the new member
+     *  Example of HTTP call (with the secret of the cluster):
+     *  curl -X POST -H "X-SmartLight-Secret: <secret>" http://localhost:9080/cluster/join/127.0.0.1:9081
+     **/
+    void JoinCluster(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            if (NotFromMember(request, response))
+                return;
+            string node = request.param(":node").as<std::string>();
+            string host;
+            int port;
+            auto members = std::atomic_load(&ring);
+            if (! members) {
+                response.send(Http::Code::Bad_Request, "The server is not in a cluster\n");
+                return;
+            }
+            if (! LightCluster::ParseNode(node, host, port)) {
+                response.send(Http::Code::Bad_Request, "The node must be given as host:port\n");
+                return;
+            }
+
+            json j;
+            j["members"] = AddMember(node);
+            for (const string& member: j["members"].get<std::vector<string>>()) {
+                if (member == self || member == node)
+                    continue;
+                forwarder->Forward(-1, member, "POST", "/cluster/members", j.dump(),
+                                   MemberHeaders(), [member](int status, const string&, const LightCluster::Headers&) {
+                    if (status != 200)
+                        printError("The member " + member + " could not be told about the new member");
+                });
+            }
+            // the new member applies the same rules to the lights it takes over
+            forwarder->Forward(-1, node, "POST", "/rules", automation.Source().dump(), MemberHeaders(),
+                               [node](int status, const string&, const LightCluster::Headers&) {
+                if (status != 200)
+                    printError("The member " + node + " could not be sent the automation rules");
+            });
+            response.send(Http::Code::Ok, j.dump(4) + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
+    /** Replace the members of the cluster (sent by the member a new server joined through)
+     *  @body request {"members": ["host:port", ...]}
+     **/
+    void SetClusterMembers(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            if (NotFromMember(request, response))
+                return;
+            if (! std::atomic_load(&ring)) {
+                response.send(Http::Code::Bad_Request, "The server is not in a cluster\n");
+                return;
+            }
+            SetMembers(json::parse(request.body())["members"].get<std::vector<string>>());
+            response.send(Http::Code::Ok, "The members were updated\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
+    /** Receive a SmartLight moved to this server by its previous owner
+     *  @param id The id of the SmartLight
+     *  @body request Its settings and alarms, as JSON
+     **/
+    void ReceiveLight(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            if (NotFromMember(request, response))
+                return;
+            int id = std::stoi(request.param(":id").as<std::string>());
+
+            if (id < 0 || id >= MaxSmartLights) { // test Id
+                response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
+                return;
+            }
+
+            json j = json::parse(request.body());
+            SmartLight sl_copy;
+            sl_copy.ImportFromJson(j);
+            if (! sl_copy.HasValidConfig()) {
+                response.send(Http::Code::Bad_Request, "Invalid setting configuration\n");
+                return;
+            }
+
+            LightGuard guard(*this, id);
+
+            slots[id].light.UpdateFromSL(sl_copy);
+            slots[id].light.ImportAlarms(j["alarms"]);
+            if (j.contains("automation"))
+                automation.ImportState(id, j["automation"]);
+            // the versions go on from the ones of the previous owner, an ETag it gave never names another state here
+            slots[id].version = std::max(slots[id].version, j.value("version", 0u)) + 1;
+            Changed(id);
+            response.send(Http::Code::Ok, "The Smart Light number " + std::to_string(id) + " was received\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
+    void setupRoutes() {
+        using namespace Rest;
+        // Defining various endpoints
+        // Generally say that when http://localhost:9080/ready is called, the handleReady function should be called
+        // All the arguments are given as strings. Convert them to the desired data type afterwards (std::stoi for string to int)
+        Routes::Get(router, "/ready", Routes::bind(&Generic::handleReady));
+        if (replica) {
+            Routes::Get(router, "/rgb/:id", Track(&SmartLightEndpoint::getRGB));
+            Routes::Get(router, "/alarm/:id", Track(&SmartLightEndpoint::GetAlarms));
+            Routes::Get(router, "/settings/:id", Track(&SmartLightEndpoint::GetSettingsJSON));
+            return;
+        }
+        Routes::Post(router, "/init/:id", Track(&SmartLightEndpoint::initSmartLight, true));
+        Routes::Post(router, "/rgb/:id/:red/:green/:blue", Track(&SmartLightEndpoint::setRGB, true));
+        Routes::Get(router, "/rgb/:id", Track(&SmartLightEndpoint::getRGB));
+        Routes::Post(router, "/alarm/:id/:hour/:minute", Track(&SmartLightEndpoint::AddAlarm, true));
+        Routes::Delete(router, "/alarm/:id/:hour/:minute", Track(&SmartLightEndpoint::RemoveAlarm, true));
+        Routes::Get(router, "/alarm/:id", Track(&SmartLightEndpoint::GetAlarms));
+ 
+        Routes::Post(router, "/play/:id/:playnow", Track(&SmartLightEndpoint::PlaySong, true));
+        Routes::Post(router, "/reactive/:id/:enabled", Track(&SmartLightEndpoint::setReactive, true));
+        Routes::Post(router, "/mode/:id/:mode", Track(&SmartLightEndpoint::setMode, true));
+
+        Routes::Get(router, "/settings/:id", Track(&SmartLightEndpoint::GetSettingsJSON));
+        Routes::Post(router, "/settings", Track(&SmartLightEndpoint::SetSettingsJSON));
+
+        Routes::Get(router, "/output", Track(&SmartLightEndpoint::getOutputs));
+        Routes::Get(router, "/output/:id", Track(&SmartLightEndpoint::getOutput));
+        Routes::Get(router, "/history/:id/:from/:to/:points", Track(&SmartLightEndpoint::GetHistory));
+
+        Routes::Get(router, "/trace", Track(&SmartLightEndpoint::GetTrace));
+        Routes::Get(router, "/rules", Track(&SmartLightEndpoint::GetRules));
+        Routes::Post(router, "/rules", Track(&SmartLightEndpoint::SetRules));
+
+        Routes::Get(router, "/cluster", Track(&SmartLightEndpoint::GetCluster));
+        Routes::Post(router, "/cluster/join/:node", Track(&SmartLightEndpoint::JoinCluster));
+        Routes::Post(router, "/cluster/members", Track(&SmartLightEndpoint::SetClusterMembers));
+        Routes::Put(router, "/cluster/light/:id", Track(&SmartLightEndpoint::ReceiveLight));
+    }
+
+    /** Run the automation rules over a changed input of a SmartLight and apply the scenes that fired
+     *  (must be called while holding the lock of its shard)
+     *  @param id The id of the SmartLight
+     *  @param input The input that changed
+     *  @param value Its new value
+     **/
+    void Automate(int id, LightRules::Input input, int value) {
+        std::vector<LightRules::Action> fired;
+        automation.Event(id, input, value, fired);
+        if (fired.empty())
+            return;
+        LightReplica::WriteSection writing(slots[id].seq); // a no-op if the caller marked it already
+        SmartLight &sl = slots[id].light;
+        for (const LightRules::Action& action: fired) {
+            if (action.mask & LightRules::Action::Powered)
+                sl.SetPower(action.powered);
+            if (action.mask & LightRules::Action::Manual)
+                sl.setMode(action.manual);
+            if (action.mask & LightRules::Action::Color)
+                sl.setColor(action.R, action.G, action.B);
+            if (action.mask & LightRules::Action::Luminosity)
+                sl.SetLuminosity(action.luminosity);
+            if (action.mask & LightRules::Action::Temperature)
+                sl.SetTemperature(action.temperature);
+        }
+        Changed(id);
+    }
+
+    // Every minute: the time of the day and the alarms of the lights are the inputs of the rules,
+    // and the automatic lights follow the time of the day (their versions change with them)
+    void Tick() {
+        std::unique_lock<std::mutex> guard(clockLock);
+        while (! clockStopping) {
+            std::time_t now = std::time(nullptr);
+            struct tm local;
+            localtime_r(&now, &local);
+            guard.unlock();
+            for (int id = 0; id < MaxSmartLights; id++) {
+                if (! Owns(id))
+                    continue;
+                LightGuard lightGuard(*this, id, LightGuard::Read);
+                if (! slots[id].light.IsInit())
+                    continue;
+                if (! slots[id].light.isManual())
+                    UpdateOutput(id);
+                Automate(id, LightRules::Time, local.tm_hour * 60 + local.tm_min);
+                Automate(id, LightRules::Alarm, slots[id].light.HasAlarm(local.tm_hour, local.tm_min));
+            }
+            guard.lock();
+            clockWakeup.wait_for(guard, std::chrono::seconds(60 - local.tm_sec));
+        }
+    }
+
+    void StopClock() {
+        {
+            std::lock_guard<std::mutex> guard(clockLock);
+            clockStopping = true;
+            clockWakeup.notify_all();
+        }
+        if (clock.joinable())
+            clock.join();
+    }
+
+    // Whether the requests for a SmartLight are handled by this server (always, out of a cluster)
+    bool Owns(int id) {
+        auto members = std::atomic_load(&ring);
+        return ! members || members->Owner(id) == self;
+    }
+
+    /** Get the spans of the sampled requests, in the Chrome trace format
+     *  Example of HTTP call:
+     *  curl -X GET http://localhost:9080/trace > trace.json
+     **/
+    void GetTrace(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            if (! tracer.Enabled()) {
+                response.send(Http::Code::Bad_Request, "The tracing is not enabled (start the server with trace=<rate>)\n");
+                return;
+            }
+            response.send(Http::Code::Ok, tracer.Export() + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
+    /** Get the automation rules
+     *  Example of HTTP call:
+     *  curl -X GET http://localhost:9080/rules
+     **/
+    void GetRules(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            response.send(Http::Code::Ok, automation.Source().dump(4) + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
+    /** Replace the automation rules (see lightrules.cpp for their format); they are saved to automation_rules.json
+     *  In a cluster, the rules set on one member are sent to all the others.
+     *  @body request The rules, as a JSON array
+     *  Example of HTTP call:
+     *  curl -X POST -d @automation_rules_sample.json http://localhost:9080/rules
+     **/
+    void SetRules(const Rest::Request& request, Http::ResponseWriter response) {
+        try {
+            json rules;
+            try {
+                rules = json::parse(request.body());
+                automation.Load(rules);
+            } catch (const string& str) {
+                response.send(Http::Code::Bad_Request, str + "\n");
+                return;
+            } catch (const json::exception&) {
+                response.send(Http::Code::Bad_Request, "The rules are not valid JSON\n");
+                return;
+            }
+
+            auto members = std::atomic_load(&ring);
+            if (members && ! FromMember(request)) {
+                for (const string& member: members->Nodes()) {
+                    if (member == self)
+                        continue;
+                    forwarder->Forward(-1, member, "POST", "/rules", rules.dump(), MemberHeaders(),
+                                       [member](int status, const string&, const LightCluster::Headers&) {
+                        if (status != 200)
+                            printError("The member " + member + " could not be sent the automation rules");
+                    });
+                }
+            }
+
+            // the rules are saved by the I/O executor, the response is sent once they are on disk
+            auto writer = std::make_shared<Http::ResponseWriter>(std::move(response));
+            limiter.Hold();
+            ioExecutor.Write(RulesFile, rules.dump(4), false, [this, writer](const string& error) {
+                try {
+                    if (! error.empty()) {
+                        printError(error);
+                        writer->send(Http::Code::Internal_Server_Error, "The rules are applied but could not be saved\n");
+                    } else {
+                        writer->send(Http::Code::Ok, "The rules were set\n");
+                    }
+                } catch (...) {
+                    writer->send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+                }
+                limiter.Release();
+            });
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
         }
     }
 
-    ~SmartLightEndpoint() {   
+    /** Get the history of a SmartLight, downsampled
+     *  @param id The id of the SmartLight
+     *  @param from Start of the time range (milliseconds since the epoch)
+     *  @param to End of the time range (excluded)
+     *  @param points Number of buckets the range is split into (at most 1000)
+     *  Example of HTTP call:
+     *  curl -X GET http://localhost:9080/history/0/1621850000000/1621853600000/60
+     **/
+    void GetHistory(const Rest::Request& request, Http::ResponseWriter response) {
         try {
-            if (fdSConfig != -1) {
-                if (mapSConfig != MAP_FAILED)
-                    munmap (mapSConfig, MaxSmartLights * sizeof(SmartLight));
-                close(fdSConfig);
-            } else {
-                delete[] smartLights;
+            int id = std::stoi(request.param(":id").as<std::string>());
+            long long from = std::stoll(request.param(":from").as<std::string>());
+            long long to = std::stoll(request.param(":to").as<std::string>());
+            int points = std::stoi(request.param(":points").as<std::string>());
+
+            if (id < 0 || id >= MaxSmartLights) { // test Id
+                response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
+                return;
             }
-        } catch (...) {
-            printError("Error in deleting the Shared Memory Map");
+
+            if (from >= to || points <= 0) {
+                response.send(Http::Code::Bad_Request, "The time range is not valid\n");
+                return;
+            }
+
+            // the history is lock free, no light lock is needed
+            json j = json::array();
+            for (const LightHistory::Bucket& bucket: history.Query(id, from, to, points)) {
+                json jBucket;
+                jBucket["from"] = bucket.from;
+                jBucket["to"] = bucket.to;
+                if (bucket.sensors) {
+                    jBucket["s_luminosity"] = bucket.sLuminosity;
+                    jBucket["s_temperature"] = bucket.sTemperature;
+                }
+                if (bucket.impacts) {
+                    jBucket["impacts"] = bucket.impacts;
+                    jBucket["max_impact"] = bucket.maxImpact;
+                }
+                if (bucket.hasState) {
+                    jBucket["R"] = (bucket.state[0] >> 16) & 255;
+                    jBucket["G"] = (bucket.state[0] >> 8) & 255;
+                    jBucket["B"] = bucket.state[0] & 255;
+                    jBucket["luminosity"] = bucket.state[1];
+                    jBucket["temperature"] = bucket.state[2];
+                    jBucket["powered"] = (bool) (bucket.state[3] & 1);
+                    jBucket["manual"] = (bool) (bucket.state[3] & 2);
+                }
+                j.push_back(jBucket);
+            }
+
+            response.send(Http::Code::Ok, j.dump(4) + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
         }
-        alertCounter = 0;
-        fdSConfig    = -1;
-        mapSConfig   = (char *) MAP_FAILED;
     }
 
-    // Initialization of the server. Additional options can be provided here
-    void init(size_t thr = 2) {
-        auto opts = Http::Endpoint::options()
-            .threads(static_cast<int>(thr));
-        httpEndpoint->init(opts);
-        // Server routes are loaded up
-        setupRoutes();
+    /** Load the current settings of a SmartLight into the output frame and convert its shard
+     *  (in one batch, see lightcolor.cpp), so the GETs only read the frame
+     *  (must be called while holding the lock of its shard)
+     *  @param id The id of the SmartLight that was changed
+     **/
+    void UpdateOutput(int id) {
+        // the automatic values are written into the record (a no-op if the caller marked it already)
+        LightReplica::WriteSection writing(slots[id].seq);
+        SmartLight &sl = slots[id].light;
+        if (! sl.isManual()) {
+            sl.setLuminosityAuto();
+            sl.SetTemperatureAuto();
+        }
+        LightColor::Input in = {sl.IsPowered(), sl.GetR(), sl.GetG(), sl.GetB(),
+                                sl.GetLuminosity(), sl.GetTemperature()};
+        outputFrame.Set(id, in);
+        outputFrame.Render(id / ShardSize);
     }
 
-    // Server is started threaded
-    void start() {
-        httpEndpoint->setHandler(router.handler());
-        httpEndpoint->serveThreaded();
+    /** Record a change of a SmartLight made by a request: update its output and its history
+     *  (must be called while holding the lock of its shard)
+     *  @param id The id of the SmartLight that was changed
+     **/
+    void Changed(int id) {
+        LightTrace::Span span(LightTrace::ModelUpdate);
+        UpdateOutput(id);
+        SmartLight &sl = slots[id].light;
+        history.Append(id, LightHistory::State, sl.GetR() << 16 | sl.GetG() << 8 | sl.GetB(),
+                       sl.GetLuminosity(), sl.GetTemperature(), sl.IsPowered() | sl.isManual() << 1);
     }
 
-    // When signaled server shuts down
-    void stop(){
-        httpEndpoint->shutdown();
-    }
+    /** Get the values that are sent to a SmartLight device
+     *  (color corrected for the temperature and scaled by the luminosity)
+     * @param id The id of the SmartLight
+     **/
+    void getOutput(const Rest::Request& request, Http::ResponseWriter response){
+        try {
+            int id = std::stoi(request.param(":id").as<std::string>());
 
-private:
-    void setupRoutes() {
-        using namespace Rest;
-        // Defining various endpoints
-        // Generally say that when http://localhost:9080/ready is called, the handleReady function should be called
-        // All the arguments are given as strings. Convert them to the desired data type afterwards (std::stoi for string to int)
-        Routes::Get(router, "/ready", Routes::bind(&Generic::handleReady));
-        Routes::Post(router, "/init/:id", Routes::bind(&SmartLightEndpoint::initSmartLight, this));
-        Routes::Post(router, "/rgb/:id/:red/:green/:blue", Routes::bind(&SmartLightEndpoint::setRGB, this));
-        Routes::Get(router, "/rgb/:id", Routes::bind(&SmartLightEndpoint::getRGB, this));
-        Routes::Post(router, "/alarm/:id/:hour/:minute", Routes::bind(&SmartLightEndpoint::AddAlarm, this));
-        Routes::Delete(router, "/alarm/:id/:hour/:minute", Routes::bind(&SmartLightEndpoint::RemoveAlarm, this));
-        Routes::Get(router, "/alarm/:id", Routes::bind(&SmartLightEndpoint::GetAlarms, this));
- 
-        Routes::Post(router, "/play/:id/:playnow", Routes::bind(&SmartLightEndpoint::PlaySong, this));
-        Routes::Post(router, "/mode/:id/:mode", Routes::bind(&SmartLightEndpoint::setMode, this));
+            if (id < 0 || id >= MaxSmartLights) { // test Id
+                response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
+                return;
+            }
+
+            LightGuard guard(*this, id, LightGuard::Read);
+
+            if (! slots[id].light.IsInit()) { // don't use if not init
+                response.send(Http::Code::Bad_Request, "This smart light was not init\n");
+                return;
+            }
+
+            int R, G, B;
+            outputFrame.Get(id, R, G, B);
+            response.send(Http::Code::Ok, "The output color is " + std::to_string(R) + ", " +
+                                          std::to_string(G) + ", " + std::to_string(B) + ".\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
 
-        Routes::Get(router, "/settings/:id", Routes::bind(&SmartLightEndpoint::GetSettingsJSON, this));
-        Routes::Post(router, "/settings", Routes::bind(&SmartLightEndpoint::SetSettingsJSON, this));
+    /** Get the values sent to every SmartLight device
+     *  (a JSON object of the R, G, B of every light that was init)
+     *  Example of HTTP call:
+     *  curl -X GET http://localhost:9080/output
+     **/
+    void getOutputs(const Rest::Request& request, Http::ResponseWriter response){
+        try {
+            json frame = json::object();
+            for (int shard = 0; shard < NrShards; shard++) {
+                LightGuard guard(*this, shard * ShardSize, LightGuard::Read);
+                int last = std::min(MaxSmartLights, (shard + 1) * ShardSize);
+                for (int id = shard * ShardSize; id < last; id++) {
+                    // in a cluster, the other lights are converted by their owners
+                    if (! slots[id].light.IsInit() || ! Owns(id))
+                        continue;
+                    int R, G, B;
+                    outputFrame.Get(id, R, G, B);
+                    frame[std::to_string(id)] = {R, G, B};
+                }
+            }
+            response.send(Http::Code::Ok, frame.dump() + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
     }
 
     /** Setup a SmartLight
@@ -210,13 +1238,19 @@ private:
                 return;
             }
 
-            if (smartLights[id].IsInit()) { // prevent multiple init
+            LightGuard guard(*this, id);
+            if (! Precondition(request, response, id)) // If-Match
+                return;
+
+            if (slots[id].light.IsInit()) { // prevent multiple init
                 response.send(Http::Code::Bad_Request, "This smart light was already init\n");
                 return;
             }
             // else not init
 
-            smartLights[id].Init();
+            slots[id].light.Init();
+            Changed(id);
+            Tag(response, id, guard.Commit());
             response.send(Http::Code::Ok, "The Smart Light setup has completed!\n");
         }
         catch (...) {
@@ -237,22 +1271,26 @@ private:
             int G = std::stoi(request.param(":green").as<std::string>());
             int B = std::stoi(request.param(":blue").as<std::string>());
 
-            // This is a guard that prevents editing the same value by two concurent threads.
-            Guard guard(smartLightLock);
-
             if (id < 0 || id >= MaxSmartLights) { // test Id
                 response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
                 return;
             }
 
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            // This is a guard that prevents editing the same value by two concurent threads.
+            LightGuard guard(*this, id);
+            if (! Precondition(request, response, id)) // If-Match
+                return;
+
+            if (! slots[id].light.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
 
-            bool setResponse = smartLights[id].setColor(R, G, B);
+            bool setResponse = slots[id].light.setColor(R, G, B);
 
             if (setResponse) {
+                Changed(id);
+                Tag(response, id, guard.Commit());
                 response.send(Http::Code::Ok, "The color of the Smart Light number " + std::to_string(id) + " was set to " +
                                             std::to_string(R) + ", "+ std::to_string(G) + ", " + std::to_string(B) + ".");
             }
@@ -272,19 +1310,28 @@ private:
         try {
             int id = std::stoi(request.param(":id").as<std::string>());
 
-            Guard guard(smartLightLock);
-
             if (id < 0 || id >= MaxSmartLights) { // test Id
                 response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
                 return;
             }
 
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            SmartLight sl;
+            uint32_t version;
+            if (! Snapshot(id, sl, version)) {
+                response.send(Http::Code::Service_Unavailable, "This smart light is being changed, try again\n");
+                return;
+            }
+
+            if (! sl.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
 
-            string valueSetting = smartLights[id].getColor();
+            if (NotModified(request, response, id, version))
+                return;
+
+            LightTrace::Span span(LightTrace::Serialize);
+            string valueSetting = sl.getColor();
 
             if (valueSetting != "") {
                 response.send(Http::Code::Ok, "The color is " + valueSetting + ".\n");
@@ -324,19 +1371,33 @@ private:
                 return;
             }
 
-            std::ofstream file;
-            string file_name = "playing_" + std::to_string(id) + ".mp3\n";
-            if (playnow == 1) {
-                file.open(file_name, std::ofstream::out);
-                file<<file_content;
-                file.close();
-                response.send(Http::Code::Ok, "Playing the song right now.\n");
-            } else {
-                file.open(file_name, std::ofstream::app);
-                file<<file_content;
-                file.close();
-                response.send(Http::Code::Ok, "Song added to queue.\n");
-            }
+            // the song is written by the I/O executor, the response is sent once it is on disk
+            auto writer = std::make_shared<Http::ResponseWriter>(std::move(response));
+            limiter.Hold();
+            ioExecutor.Write(SongFile(id), file_content, playnow == 0, [this, id, playnow, writer](const string& error) {
+                try {
+                    if (! error.empty()) {
+                        printError(error);
+                        writer->send(Http::Code::Internal_Server_Error, "The song could not be saved\n");
+                    } else if (playnow == 1) {
+                        // the light reacts to the new song from its beginning
+                        string reaction;
+                        try {
+                            if (musicPool.IsRunning(id))
+                                musicPool.Start(ReactiveSession(id));
+                        } catch (char const* str) {
+                            musicPool.Cancel(id);
+                            reaction = (string) " The light stopped reacting to the music: " + str;
+                        }
+                        writer->send(Http::Code::Ok, "Playing the song right now." + reaction + "\n");
+                    } else {
+                        writer->send(Http::Code::Ok, "Song added to queue.\n");
+                    }
+                } catch (...) {
+                    writer->send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+                }
+                limiter.Release();
+            });
         }
         catch (...) {
             response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
@@ -344,27 +1405,144 @@ private:
     }
 
 
+    static string SongFile(int id) {
+        return "playing_" + std::to_string(id) + ".mp3";
+    }
+
+    // Apply the updates of a control channel message straight to the lights, the same way the music does
+    // (no HTTP request and no per light rate limit; the lights of other members of a cluster are skipped)
+    void ControlLights(const std::vector<LightControl::Update>& updates) {
+        for (const LightControl::Update& update: updates) {
+            if (update.id < 0 || update.id >= MaxSmartLights || ! Owns(update.id))
+                continue;
+            LightGuard guard(*this, update.id);
+            SmartLight &sl = slots[update.id].light;
+            if (! sl.IsInit())
+                continue;
+            sl.setColor(update.R, update.G, update.B);
+            // the automatic mode would override the luminosity, like for the music the light is switched to manual
+            if (update.luminosity != LightControl::KeepLuminosity && sl.SetLuminosity(update.luminosity))
+                sl.setMode(true);
+            UpdateOutput(update.id);
+        }
+    }
+
+    // Apply the lights changed by a batch of DMX frames, the same way as the control channel
+    void DmxLights(const std::vector<LightDmx::Change>& changes) {
+        for (const LightDmx::Change& change: changes) {
+            if (! Owns(change.light))
+                continue;
+            LightGuard guard(*this, change.light);
+            SmartLight &sl = slots[change.light].light;
+            if (! sl.IsInit())
+                continue;
+            sl.setColor(change.R, change.G, change.B);
+            // a patched dimmer switches the light to manual, the automatic mode would override it
+            if (change.luminosity != -1 && sl.SetLuminosity(change.luminosity))
+                sl.setMode(true);
+            UpdateOutput(change.light);
+        }
+    }
+
+    // The analysis of the song of a light, every analyzed moment updates its color and luminosity;
+    // throws a message if the song cannot be decoded
+    std::shared_ptr<LightMusic::Session> ReactiveSession(int id) {
+        return std::make_shared<LightMusic::Session>(id, SongFile(id), [this, id](const LightMusic::Reaction& reaction) {
+            LightGuard guard(*this, id);
+            if (! slots[id].light.IsInit())
+                return;
+            slots[id].light.setColor(reaction.R, reaction.G, reaction.B);
+            slots[id].light.SetLuminosity(reaction.luminosity);
+            UpdateOutput(id);
+        });
+    }
+
+    /** Make a SmartLight react to the song it is playing
+     *  @param id The id of the SmartLight
+     *  @param enabled 1 to react to the music (the light is switched to manual), 0 to stop
+     *  Example of HTTP call:
+     *  curl -X POST http://localhost:9080/reactive/1/1
+     **/
+    void setReactive(const Rest::Request& request, Http::ResponseWriter response){
+        try {
+            int id = std::stoi(request.param(":id").as<std::string>());
+            int enabled = std::stoi(request.param(":enabled").as<std::string>());
+
+            if (enabled < 0 || enabled > 1) {
+                response.send(Http::Code::Bad_Request, "Wrong option for enabled\n");
+                return;
+            }
+
+            if (id < 0 || id >= MaxSmartLights) { // test Id
+                response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
+                return;
+            }
+
+            // the song is read and decoded before the lock of the shard is taken, and
+            // one that cannot be decoded is refused before the light is changed
+            std::shared_ptr<LightMusic::Session> session;
+            if (enabled)
+                session = ReactiveSession(id);
+
+            {
+                LightGuard guard(*this, id);
+                if (! Precondition(request, response, id)) // If-Match
+                    return;
+
+                if (! slots[id].light.IsInit()) { // don't use if not init
+                    response.send(Http::Code::Bad_Request, "This smart light was not init\n");
+                    return;
+                }
+
+                if (enabled) {
+                    // the automatic mode would override the luminosity set by the music
+                    slots[id].light.setMode(true);
+                    Changed(id);
+                }
+            }
+
+            if (! enabled) {
+                musicPool.Cancel(id);
+                response.send(Http::Code::Ok, "The Smart Light number " + std::to_string(id) + " stopped reacting to the music\n");
+                return;
+            }
+
+            musicPool.Start(session);
+            response.send(Http::Code::Ok, "The Smart Light number " + std::to_string(id) + " reacts to the music\n");
+        }
+        catch (char const* str) {
+            response.send(Http::Code::Bad_Request, (string) str + "\n");
+        }
+        catch (...) {
+            response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
+        }
+    }
+
     void setMode(const Rest::Request& request, Http::ResponseWriter response){
         try {
             bool mode = std::stoi(request.param(":mode").as<std::string>());
             int id = std::stoi(request.param(":id").as<std::string>());
 
-            // This is a guard that prevents editing the same value by two concurent threads.
-            Guard guard(smartLightLock);
-
             if (id < 0 || id >= MaxSmartLights) { // test Id
                 response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
                 return;
             }
 
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            // This is a guard that prevents editing the same value by two concurent threads.
+            LightGuard guard(*this, id);
+            if (! Precondition(request, response, id)) // If-Match
+                return;
+
+            if (! slots[id].light.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
 
-            bool setResponse = smartLights[id].setMode(mode);
+            bool setResponse = slots[id].light.setMode(mode);
 
             if (setResponse) {
+                Changed(id);
+                Tag(response, id, guard.Commit());
                 response.send(Http::Code::Ok, "The mode of the Smart Light number " + std::to_string(id) + " was set to " + std::to_string(mode) );
             }
             else {
@@ -379,8 +1557,6 @@ private:
 
     void GetSettingsJSON(const Rest::Request& request, Http::ResponseWriter response) {
         try {
-            Guard guard(smartLightLock);
-
             int id = std::stoi(request.param(":id").as<std::string>());
 
             if (id < 0 || id >= MaxSmartLights) { // test Id
@@ -388,12 +1564,25 @@ private:
                 return;
             }
 
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            SmartLight sl;
+            uint32_t version;
+            if (! Snapshot(id, sl, version)) {
+                response.send(Http::Code::Service_Unavailable, "This smart light is being changed, try again\n");
+                return;
+            }
+
+            if (! sl.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
 
-            response.send(Http::Code::Ok, smartLights[id].Repr() + "\n");
+            if (NotModified(request, response, id, version))
+                return;
+
+            LightTrace::Span span(LightTrace::Serialize);
+            string body = sl.Repr() + "\n";
+            span.End();
+            response.send(Http::Code::Ok, body);
         }
         catch (...) {
             response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
@@ -406,9 +1595,9 @@ private:
         string settings[nrSettings] = {"powered", "luminosity", "temperature", "R", "G", "B", "manual", "s_temperature", "s_luminosity"};
 
         try {
-            Guard guard(smartLightLock);
-
+            LightTrace::Span parse(LightTrace::Parse);
             auto j = json::parse(request.body())["input_buffers"];
+            parse.End();
 
             json jSettings = j["settings"];
             int id = std::stoi((string) jSettings["id"]);
@@ -418,12 +1607,16 @@ private:
                 return;
             }
 
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            LightGuard guard(*this, id);
+            if (! Precondition(request, response, id)) // If-Match
+                return;
+
+            if (! slots[id].light.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
 
-            SmartLight sl_copy = SmartLight(smartLights[id]);
+            SmartLight sl_copy = SmartLight(slots[id].light);
             json jsonSettings;
             sl_copy.ExportToJson(jsonSettings);
             string rsp = "";
@@ -433,6 +1626,14 @@ private:
                 json jCurr = iter.value();
                 string jName = jCurr["name"];
 
+                // the tokens of the schema are checked against their compiled rules
+                string jValue, error;
+                const LightSchema::Validator* validator = schema.Find(jName);
+                if (validator && ! validator->Check(jCurr["value"], jValue, error)) {
+                    response.send(Http::Code::Bad_Request, error + "\n");
+                    return;
+                }
+
                 for (int i = 0; i < nrSettings; i++) {
                     if (jName == settings[i]) {
                         isSetting = true;
@@ -446,7 +1647,8 @@ private:
                 }
                 else {
                     bool validRsp = true;
-                    string jValue = jCurr["value"];
+                    if (! validator)
+                        jValue = jCurr["value"];
                     try {
                         jsonSettings[jName] = std::stoi(jValue);
                     } catch (...) {
@@ -461,12 +1663,22 @@ private:
                 }
             }
     
+            LightTrace::Span update(LightTrace::ModelUpdate);
             sl_copy.ImportFromJson(jsonSettings);
             //printInfo(sl_copy.Repr());
 
             if (sl_copy.HasValidConfig()) {
-                smartLights[id].UpdateFromSL(sl_copy);
+                slots[id].light.UpdateFromSL(sl_copy);
+                update.End();
+                Changed(id);
+                if (jsonSettings["s_luminosity"] != null || jsonSettings["s_temperature"] != null)
+                    history.Append(id, LightHistory::Sensor, sl_copy.GetSensorLuminosity(), sl_copy.GetSensorTemperature());
+                if (jsonSettings["s_luminosity"] != null)
+                    Automate(id, LightRules::SensorLuminosity, sl_copy.GetSensorLuminosity());
+                if (jsonSettings["s_temperature"] != null)
+                    Automate(id, LightRules::SensorTemperature, sl_copy.GetSensorTemperature());
                 // TODO Update values in file (save state)
+                Tag(response, id, guard.Commit());
                 response.send(Http::Code::Ok, rsp);
             } else {
                 // invalid configuration -> the previous value remain unchanged
@@ -487,25 +1699,30 @@ private:
             int hours = std::stoi(request.param(":hour").as<std::string>());
             
             int minutes = std::stoi(request.param(":minute").as<std::string>());
-            // This is a guard that prevents editing the same value by two concurent threads. 
-            Guard guard(smartLightLock);
-
             if (id < 0 || id >= MaxSmartLights) { // test Id
                 response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
                 return;
             }
+
+            // This is a guard that prevents editing the same value by two concurent threads.
+            LightGuard guard(*this, id);
+            if (! Precondition(request, response, id)) // If-Match
+                return;
+
             if (hours < 0 || hours >= 24 || minutes < 0 || minutes >= 60) { // test time
                 response.send(Http::Code::Bad_Request, "The Time is not valid\n");
                 return;
             }
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            if (! slots[id].light.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
-            if(!smartLights[id].AddHour(hours,minutes))
+            if(!slots[id].light.AddHour(hours,minutes))
                 response.send(Http::Code::Bad_Request, "You have reached the maximum number of alarms, please remove some unused alarms\n");
-            else
+            else {
+                Tag(response, id, guard.Commit());
                 response.send(Http::Code::Ok, "The alarm was succesfully set\n");
+            }
         }
         catch (...) {
             response.send(Http::Code::Internal_Server_Error, "Something unexpected happened\n");
@@ -520,28 +1737,32 @@ private:
             int hours = std::stoi(request.param(":hour").as<std::string>());
             int minutes = std::stoi(request.param(":minute").as<std::string>());
 
-            // This is a guard that prevents editing the same value by two concurent threads. 
-            Guard guard(smartLightLock);
-
             if (id < 0 || id >= MaxSmartLights) { // test Id
                 response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
                 return;
             }
+
+            // This is a guard that prevents editing the same value by two concurent threads.
+            LightGuard guard(*this, id);
+            if (! Precondition(request, response, id)) // If-Match
+                return;
             
             if (hours < 0 || hours >= 24 || minutes < 0 || minutes >= 60) { // test time
                 response.send(Http::Code::Bad_Request, "The Time is not valid\n");
                 return;
             }
 
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            if (! slots[id].light.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
 
-            if(!smartLights[id].RemoveHour(hours,minutes))
+            if(!slots[id].light.RemoveHour(hours,minutes))
                 response.send(Http::Code::Bad_Request, "The alarm that you want to remove was not found\n");
-            else
+            else {
+                Tag(response, id, guard.Commit());
                 response.send(Http::Code::Ok, "The alarm was succesfully removed\n");
+            }
     
         }
         catch (...) {
@@ -558,19 +1779,26 @@ private:
           
             int id = std::stoi(request.param(":id").as<std::string>());
         
-            // This is a guard that prevents editing the same value by two concurent threads. 
-            Guard guard(smartLightLock);
           
             if (id < 0 || id >= MaxSmartLights) { // test Id
                 response.send(Http::Code::Bad_Request, "The Id is unavailable\n");
                 return;
             }
+
+            SmartLight sl;
+            uint32_t version;
+            if (! Snapshot(id, sl, version)) {
+                response.send(Http::Code::Service_Unavailable, "This smart light is being changed, try again\n");
+                return;
+            }
            
-            if (! smartLights[id].IsInit()) { // don't use if not init
+            if (! sl.IsInit()) { // don't use if not init
                 response.send(Http::Code::Bad_Request, "This smart light was not init\n");
                 return;
             }
-            string a = smartLights[id].getAlarms(); 
+            if (NotModified(request, response, id, version))
+                return;
+            string a = sl.getAlarms(); 
             
             response.send(Http::Code::Ok, a + "\n");
            
@@ -719,6 +1947,34 @@ private:
             return this->manual;
         }
 
+        int GetR() {
+            return this->R;
+        }
+
+        int GetG() {
+            return this->G;
+        }
+
+        int GetB() {
+            return this->B;
+        }
+
+        int GetSensorLuminosity() {
+            return this->sensorInfo[0];
+        }
+
+        int GetSensorTemperature() {
+            return this->sensorInfo[1];
+        }
+
+        int GetLuminosity() {
+            return this->luminosity;
+        }
+
+        int GetTemperature() {
+            return this->temperature;
+        }
+
         void setLuminosityAuto(){
             this->luminosity = (100 - this->sensorInfo[0])%101;
         }
@@ -784,6 +2040,33 @@ private:
         }
 
         
+        void ExportAlarms(json &j) {
+            j = json::array();
+            for (int i=0;i<=9;i++){
+                if(this->hours[i] != -1)
+                    j.push_back({this->hours[i], this->minutes[i]});
+            }
+        }
+
+        void ImportAlarms(const json &j) {
+            for (int i=0;i<=9;i++){
+                this->hours[i] = -1;
+                this->minutes[i] = -1;
+            }
+            if (j.is_array()) {
+                for (const json &alarm: j)
+                    this->AddHour(alarm[0], alarm[1]);
+            }
+        }
+
+        bool HasAlarm(int hour, int minute){
+            for (int i=0;i<=9;i++){
+                if(this->hours[i] == hour && this->minutes[i] == minute)
+                    return true;
+            }
+            return false;
+        }
+
         string getAlarms(){
 
             string resp = "";
@@ -893,15 +2176,225 @@ private:
     // Create the lock which prevents concurrent editing of the same variable
     using Lock = std::mutex;
     using Guard = std::lock_guard<Lock>;
-    Lock smartLightLock;
 
     static const int MaxSmartLights = 10;
 
-    // Collection of Smart Lights
-    SmartLight* smartLights;
+    // The lights are split in shards of consecutive ids, each with its own lock, so requests
+    // for lights of different shards never wait for each other. A shard is a conversion group
+    // of the output frame, and every lock is on its own cache line.
+    static const int ShardSize = LightColor::Lanes;
+    static const int NrShards  = (MaxSmartLights + ShardSize - 1) / ShardSize;
+
+    struct alignas(64) Shard {
+        Lock lock;
+    };
+    Shard shards[NrShards];
+
+    Lock& LockOf(int id) {
+        return shards[id / ShardSize].lock;
+    }
+
+    // A record of SettingConfigs.data: a Smart Light behind the sequence lock of the replicas
+    // and its version, the ETag of its state (changed by every change of the light)
+    struct Slot {
+        std::atomic<uint32_t> seq{0};
+        uint32_t version = 0;
+        SmartLight light;
+    };
+
+    // Holds the lock of the shard of a light and marks its record as being written for the replicas
+    // (the waiting for the lock and the holding of it are spans of a traced request). A Read guard
+    // only marks the record once something changes it (the rules or the automatic values), so the
+    // replicas keep reading the light meanwhile.
+    // A new version of the light is committed if it was changed while the lock was held
+    // (and pushed to the clients of the control channel).
+    class LightGuard {
+    public:
+        enum Access { Write, Read };
+
+        LightGuard(SmartLightEndpoint &server, int id, Access access = Write)
+            : wait(LightTrace::LockWait), guard(server.LockOf(id)), hold(LightTrace::LockHold),
+              writing(server.slots[id].seq, access == Read), server(server), slot(server.slots[id])
+        {
+            wait.End();
+            memcpy((void *) &before, &slot.light, sizeof(SmartLight));
+        }
+
+        ~LightGuard() {
+            Commit();
+        }
+
+        // The version of the light, a new one if it was changed since the last commit
+        uint32_t Commit() {
+            if (memcmp((void *) &before, (void *) &slot.light, sizeof(SmartLight)) != 0) {
+                LightReplica::WriteSection bump(slot.seq); // already open, unless a Read guard
+                slot.version++;
+                memcpy((void *) &before, &slot.light, sizeof(SmartLight));
+                if (server.control)
+                    server.control->Changed();
+            }
+            return slot.version;
+        }
+
+    private:
+        LightTrace::Span wait;
+        Guard guard;
+        LightTrace::Span hold;
+        LightReplica::WriteSection writing;
+        SmartLightEndpoint &server;
+        Slot &slot;
+        SmartLight before;
+    };
+
+    // Collection of Smart Lights (mapped from SettingConfigs.data by activate)
+    static constexpr const char* LightsFile = "SettingConfigs.data";
+    Slot* slots = nullptr;
+
+    // SettingConfigs.data mapped by a replica, unmapped once no request reads it any more (see Mapped)
+    struct Mapping {
+        int fd;
+        Slot* slots;
+        ino_t inode;
+
+        ~Mapping() {
+            munmap((void *) slots, MaxSmartLights * sizeof(Slot));
+            close(fd);
+        }
+    };
+    std::shared_ptr<const Mapping> mapping;
+    std::atomic<long long> mappingChecked{0};
+
+    // A replica maps SettingConfigs.data read-only; throws a message if the file cannot be used
+    std::shared_ptr<const Mapping> MapReplica() {
+        int fd = open(LightsFile, O_RDONLY);
+        if (fd == -1)
+            throw "Error opening the file";
+        struct stat fileInfo = {0};
+        if (fstat(fd, &fileInfo) == -1 || fileInfo.st_size != MaxSmartLights * sizeof(Slot)) {
+            close(fd);
+            throw "Error missmatching between the file size and the to be mapped object size";
+        }
+        void *map = mmap(0, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            throw "Error Mapping Failed";
+        }
+        return std::shared_ptr<const Mapping>(new Mapping{fd, (Slot*) map, fileInfo.st_ino});
+    }
+
+    // The lights a replica reads: the file is mapped again once the server replaced it
+    // (a migration renames a new file over it, see Migrate); checked at most once a second
+    std::shared_ptr<const Mapping> Mapped() {
+        auto current = std::atomic_load(&mapping);
+        long long now = LightHistory::Now();
+        long long checked = mappingChecked;
+        if (now - checked < 1000 || ! mappingChecked.compare_exchange_strong(checked, now))
+            return current;
+        struct stat fileInfo = {0};
+        if (stat(LightsFile, &fileInfo) != 0 || fileInfo.st_ino == current->inode)
+            return current;
+        try {
+            auto replaced = MapReplica();
+            std::atomic_store(&mapping, replaced);
+            printInfo((string) LightsFile + " was replaced by the server, it is mapped again");
+            return replaced;
+        } catch (char const* str) {
+            printError((string) "Error in mapping the replaced " + LightsFile + " (the lights served are the old ones):\n\t" + str);
+        }
+        return current;
+    }
+
+    /** Copy a SmartLight: under the lock of its shard in the writing server, without
+     *  any lock in a replica (a copy made while the record was not being written)
+     *  @param id The id of the SmartLight
+     *  @param out The copy
+     *  @param version The version of the copy (see LightGuard)
+     *  @return false if no consistent copy could be made
+     **/
+    bool Snapshot(int id, SmartLight &out, uint32_t &version) {
+        if (replica) {
+            auto mapped = Mapped();
+            Slot &slot = mapped->slots[id];
+            return LightReplica::Read(slot.seq, [&] {
+                memcpy((void *) &out, &slot.light, sizeof(SmartLight));
+                version = slot.version;
+            });
+        }
+        Slot &slot = slots[id];
+        LightTrace::Span wait(LightTrace::LockWait);
+        Guard guard(LockOf(id));
+        wait.End();
+        LightTrace::Span hold(LightTrace::LockHold);
+        memcpy((void *) &out, &slot.light, sizeof(SmartLight));
+        version = slot.version;
+        return true;
+    }
+
+    // Device values of every Smart Light, converted in batches (see lightcolor.cpp)
+    LightColor::Frame outputFrame{MaxSmartLights};
+
+    // Capture of the traffic, when enabled (see lightcapture.cpp)
+    std::unique_ptr<LightCapture::Recorder> recorder;
+
+    // Sensor samples, impacts and changes of every Smart Light (see lighthistory.cpp)
+    LightHistory::Store history;
+
+    // Read-only server over the lights of another one (see the constructor)
+    bool replica;
+
+    // Spans of the sampled requests, when the tracing is enabled (see lighttrace.cpp)
+    LightTrace::Tracer tracer;
+
+    // Validators of the settings tokens (see lightschema.cpp)
+    LightSchema::Schema schema;
+
+    // Automation rules, run on the sensor, impact and alarm events (see lightrules.cpp)
+    static constexpr const char* RulesFile = "automation_rules.json";
+    LightRules::Engine automation{MaxSmartLights};
+
+    // Thread feeding the time of the day and the alarms to the rules
+    std::thread clock;
+    std::mutex clockLock;
+    std::condition_variable clockWakeup;
+    bool clockStopping = false;
+
+    // Requests are handled once the server is active, and refused while it hands over (see activate, handOver)
+    std::mutex activeLock;
+    std::condition_variable activeChanged;
+    std::atomic<bool> active{false};
+    std::atomic<bool> handingOver{false};
+    // Requests in their Track wrapper, admitted or not yet (see Handling)
+    std::atomic<int> wrapped{0};
+
+    // Admission control and number of requests in flight (including the ones waiting for their file I/O)
+    LightLimit::Limiter limiter{MaxSmartLights};
+
+    // Executor of the file I/O of the handlers (see lightio.cpp)
+    LightIO::Executor ioExecutor;
+
+    // Workers analyzing the songs of the lights in reactive mode (see lightmusic.cpp)
+    LightMusic::WorkerPool musicPool{std::max(1, (int) std::thread::hardware_concurrency() / 2)};
+
+    // Cluster mode, when enabled: the members and this server among them (see lightcluster.cpp)
+    std::shared_ptr<const LightCluster::Ring> ring;
+    string self;
+    string clusterSecret;
+    std::mutex clusterLock;
+    std::unique_ptr<LightCluster::Forwarder> forwarder;
+
+    // WebSocket clients setting the lights with binary messages (see enableControl)
+    std::unique_ptr<LightControl::Server> control;
+    int controlPort = 0;
+
+    // DMX frames of lighting consoles setting the lights patched on their universes (see enableDmx)
+    std::unique_ptr<LightDmx::Receiver> dmx;
+
+    // Whether the ports are shared with the server this one replaces or is replaced by (see init)
+    bool reusePort = false;
 
-    // Defining the httpEndpoint and a router.
-    std::shared_ptr<Http::Endpoint> httpEndpoint;
+    // Defining the httpEndpoints (one per listener) and a router.
+    Address address;
+    std::vector<std::shared_ptr<Http::Endpoint>> httpEndpoints;
     Rest::Router router;
 };
 